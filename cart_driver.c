@@ -23,6 +23,7 @@
 #define MAX_NAME_LENGTH 136 
 #define MAX_FILE_SIZE 102
 #define MAX_FILES 1030
+#define CACHE_FRAMES 64        // frames kept in the driver, 64 KB
 
 //
 // Implementation
@@ -37,9 +38,27 @@ struct file_handle {
   int32_t file_size;                 // the number of bytes contains in the file.
 };
 
+// declare cache_frame, a frame kept in memory by the driver. Reads and
+// writes go to these copies, a dirty one is written to the cart only
+// when it is evicted, its file is closed or the system powers off.
+struct cache_frame {
+  int16_t cart;                      // cart and frame this is a copy of
+  int32_t frame;
+  int8_t valid;                      // 1 if it holds a frame
+  int8_t dirty;                      // 1 if it changed since it was read
+  uint64_t last_used;                // cache_clock of its last access, for LRU
+  char data[CART_FRAME_SIZE + 1];    // 1024 byte and a tailing 0 to mark
+                                     // the end of buffer
+};
+
 // Global variables
 struct file_handle VnodeTable[MAX_FILES];
 int16_t next_fd = 0;    // index of next filehandler in vnodeTable       
+struct cache_frame FrameCache[CACHE_FRAMES];
+uint64_t cache_clock = 0;     // counts frame accesses
+int16_t loaded_cart = -1;     // cart the controller has loaded, -1 if unknown
+uint64_t bus_commands = 0;    // commands sent on the bus since power on
+uint64_t bytes_moved = 0;     // bytes read and written by callers since power on
 
 // Helper functions
 
@@ -72,6 +91,91 @@ int getRT(CartXferRegister cmd) {
   return cmd & mask; // then & 0x00000..1 to inactivate all bits except RT
 }
 
+// send cmd on the bus and count it, return 0 if successful, -1 if failure
+int bus(int64_t op, int64_t cart, int64_t frame, void *buf) {
+  bus_commands++;
+  return getRT(cart_io_bus(Generate_cmd(op, cart, frame), buf))? -1:0;
+}
+
+// load cart, unless it is loaded already
+int load_cart(int16_t cart) {
+  if (cart == loaded_cart) return 0;
+  loaded_cart = -1;   // unknown until the controller says so
+  if (bus(CART_OP_LDCART, cart, 0, NULL) != 0) return -1;
+  loaded_cart = cart;
+  return 0;
+}
+
+// empty the frame cache, without writing anything back
+void init_FrameCache(void) {
+  memset(FrameCache, 0, sizeof(FrameCache));
+  cache_clock = 0;
+}
+
+// write a dirty cached frame back to its cart
+int write_back(struct cache_frame *f) {
+  if (!f->valid || !f->dirty) return 0;
+  if (load_cart(f->cart) != 0) return -1;
+  if (bus(CART_OP_WRFRME, 0, f->frame, f->data) != 0) return -1;
+  f->dirty = 0;
+  return 0;
+}
+
+// write back the dirty frames of cart from first up to last, every one
+// of them if cart is -1
+int flush_frames(int16_t cart, int32_t first, int32_t last) {
+  int i;
+  for (i = 0; i < CACHE_FRAMES; i++) {
+    struct cache_frame *f = &FrameCache[i];
+    if (cart != -1 && (f->cart != cart || f->frame < first || f->frame > last)) continue;
+    if (write_back(f) != 0) return -1;
+  }
+  return 0;
+}
+
+// return the cached copy of frame in cart, read from the cart on a miss
+// into the least recently used slot, which is written back first if it
+// is dirty. With no_read the frame is not read: the caller overwrites
+// it whole, or it is past the end of its file and still zero from
+// CART_OP_BZERO. Return NULL if failure
+struct cache_frame *get_frame(int16_t cart, int32_t frame, int no_read) {
+  struct cache_frame *f, *victim = &FrameCache[0];
+  int i;
+  for (i = 0; i < CACHE_FRAMES; i++) {
+    f = &FrameCache[i];
+    if (f->valid && f->cart == cart && f->frame == frame) {
+      f->last_used = ++cache_clock;
+      return f;
+    }
+    // an empty slot, or else the one used longest ago
+    if (!victim->valid) continue;
+    if (!f->valid || f->last_used < victim->last_used) victim = f;
+  }
+
+  if (write_back(victim) != 0) return NULL;
+  victim->valid = 0;
+  memset(victim->data, 0, CART_FRAME_SIZE + 1);
+  if (!no_read) {
+    if (load_cart(cart) != 0) return NULL;
+    if (bus(CART_OP_RDFRME, 0, frame, victim->data) != 0) return NULL;
+  }
+  victim->cart = cart;
+  victim->frame = frame;
+  victim->valid = 1;
+  victim->dirty = 0;
+  victim->last_used = ++cache_clock;
+  return victim;
+}
+
+// print how many bus commands the driver sent for every MB callers read
+// and wrote, to compare workloads
+void cart_bus_report(void) {
+  double mb = bytes_moved / (1024.0 * 1024.0);
+  printf("CART bus: %llu commands for %llu bytes, %.1f per MB\n",
+         (unsigned long long)bus_commands, (unsigned long long)bytes_moved,
+         (mb > 0)? bus_commands / mb:0.0);
+}
+
 // Check the status of given file in VnodeTable 
 // status could be: don't exist, exist & open, exist & close
 int find_file(char* filename) {
@@ -98,29 +202,26 @@ int find_file(char* filename) {
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t cart_poweron(void) {
-  CartXferRegister return_cmd, sent_cmd;
+  bus_commands = 0;
+  bytes_moved = 0;
+  loaded_cart = -1;
 
   // sent CART_OP_INITMS
-  sent_cmd = Generate_cmd(CART_OP_INITMS, 0, 0);
-  return_cmd = cart_io_bus(sent_cmd, NULL);
-  if (getRT(return_cmd) != 0) return -1;
+  if (bus(CART_OP_INITMS, 0, 0, NULL) != 0) return -1;
 
   // load and zero out all cartridge
   int i;
   for (i = 0; i < 64; i++) {
     // Load Cart
-    sent_cmd = Generate_cmd(CART_OP_LDCART, i, 0); 
-    return_cmd = cart_io_bus(sent_cmd, NULL);
-    if (getRT(return_cmd) != 0) return -1;
+    if (load_cart(i) != 0) return -1;
 
     // Zero the Cart
-    sent_cmd = Generate_cmd(CART_OP_BZERO, 0, 0);
-    return_cmd = cart_io_bus(sent_cmd, NULL);
-    if (getRT(return_cmd) != 0) return -1; 
+    if (bus(CART_OP_BZERO, 0, 0, NULL) != 0) return -1;
   }
 
-  // initialize inner data structure (VnodeTable)
+  // initialize inner data structures (VnodeTable and frame cache)
   init_VnodeTable(); 
+  init_FrameCache();
 
   return(0);
 }
@@ -134,12 +235,13 @@ int32_t cart_poweron(void) {
 // Outputs      : 0 if successful, -1 if failure
 
 int32_t cart_poweroff(void) {
-  CartXferRegister sent_cmd, return_cmd;
+  // write back every dirty frame before the carts go away
+  if (flush_frames(-1, 0, 0) != 0) return -1;
+  init_FrameCache();
 
   // Turn off the CART system
-  sent_cmd = Generate_cmd(CART_OP_POWOFF, 0, 0);
-  return_cmd = cart_io_bus(sent_cmd, NULL);
-  if (getRT(return_cmd) != 0) return -1; 
+  if (bus(CART_OP_POWOFF, 0, 0, NULL) != 0) return -1;
+  loaded_cart = -1;
 
   // Return successfully
   return(0);
@@ -202,6 +304,11 @@ int16_t cart_close(int16_t fd) {
   // check if the file is open
   if (VnodeTable[fd].open_status == 0) return -1;
 
+  // write back the dirty frames of the file, they stay cached clean
+  int32_t first = (VnodeTable[fd].used_carts)[1];
+  if (flush_frames((VnodeTable[fd].used_carts)[0], first, first + MAX_FILE_SIZE - 1) != 0)
+    return -1;
+
   // close the file and set file_pos back to 0
   VnodeTable[fd].open_status = 0;
   VnodeTable[fd].file_pos = 0;
@@ -226,18 +333,12 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
   if (fd >= next_fd) return -1;
   if (VnodeTable[fd].open_status == 0) return -1;
 
-  CartXferRegister sent_cmd, return_cmd;
-
-  // load the cart in which the file stores
-  sent_cmd = Generate_cmd(CART_OP_LDCART, (VnodeTable[fd].used_carts)[0], 0);
-  return_cmd = cart_io_bus(sent_cmd, NULL);
-  if (getRT(return_cmd) != 0) return -1; 
+  // the cart in which the file stores, loaded only when a frame
+  // is not in the frame cache
+  int16_t cart = (VnodeTable[fd].used_carts)[0];
+  struct cache_frame *f;
 
-  // Use a while loop to read new frames until reading enough bytes
-  char cart_buf[CART_FRAME_SIZE+1];   // 1024 byte and a tailing 0 to mark
-                                      // the end of buffer. 
-  memset(cart_buf, 0, CART_FRAME_SIZE+1);
-    
+  // Use a while loop to read frames until reading enough bytes
   int32_t filepos = VnodeTable[fd].file_pos;
   int32_t filesize =  VnodeTable[fd].file_size;
 
@@ -250,20 +351,16 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
   int32_t unread = count;
 
   while(unread != 0) {
-    memset(cart_buf, 0, CART_FRAME_SIZE+1); // empty the local buffer
     if ((unread + (filepos % 1024)) <= 1024) {
       // get the frame where filepos locate
       int32_t frame = (filepos / 1024) + (VnodeTable[fd].used_carts)[1];
 
-
       // Read from this frame
-      sent_cmd = Generate_cmd(CART_OP_RDFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
+      if ((f = get_frame(cart, frame, 0)) == NULL) return -1;
 
-      // copy from cart_buf to buf (only copy the part
+      // copy from the frame to buf (only copy the part
       // after file_pos)
-      strncpy(buf, cart_buf + (filepos % 1024), unread);
+      strncpy(buf, f->data + (filepos % 1024), unread);
       
       filepos += unread;
       unread = 0;
@@ -273,13 +370,11 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
       int32_t frame = (filepos / 1024) + (VnodeTable[fd].used_carts)[1];
 
       // Read from this frame
-      sent_cmd = Generate_cmd(CART_OP_RDFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
+      if ((f = get_frame(cart, frame, 0)) == NULL) return -1;
 
-      // Copy from cart_buf to buf
+      // Copy from the frame to buf
       int16_t r_bytes = 1024 - (filepos % 1024);  // number of bytes read in this iteration
-      strncpy(buf, cart_buf + (filepos % 1024), r_bytes);
+      strncpy(buf, f->data + (filepos % 1024), r_bytes);
 
       // Update variables
       filepos += r_bytes;
@@ -291,6 +386,7 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
 
   // Update file_pos in VnodeTable
   VnodeTable[fd].file_pos = filepos;
+  bytes_moved += count;
 
   // Return successfully
   return (count);
@@ -312,17 +408,13 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count) {
   if (fd >= next_fd) return -1;
   if (VnodeTable[fd].open_status == 0) return -1;
 
-  CartXferRegister sent_cmd, return_cmd; 
   int32_t filepos = VnodeTable[fd].file_pos;
   int32_t filesize = VnodeTable[fd].file_size;
-  
-  char cart_buf[CART_FRAME_SIZE + 1];
-  memset(cart_buf, 0, CART_FRAME_SIZE + 1); 
+  int32_t oldsize = filesize;   // frames past it are still zero, no need to read them
 
-  // load the cartridge
-  sent_cmd = Generate_cmd(CART_OP_LDCART, (VnodeTable[fd].used_carts)[0], 0);
-  return_cmd = cart_io_bus(sent_cmd, NULL);
-  if (getRT(return_cmd) != 0) return -1; 
+  // the cartridge, loaded only when a frame is read or written back
+  int16_t cart = (VnodeTable[fd].used_carts)[0];
+  struct cache_frame *f;
 
   // Check if the write command enlarge the file
   if (filepos + count > filesize) {
@@ -331,45 +423,36 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count) {
 
   int32_t unwritten = count;
   while (unwritten != 0) {
-    memset(cart_buf, 0, CART_FRAME_SIZE + 1);
     if ((unwritten + (filepos % 1024)) <= 1024) {
       int32_t frame = (filepos / 1024) + (VnodeTable[fd].used_carts)[1];
+      int16_t fp = filepos % 1024; //file position within a frame
       
-      // Read the frame
-      sent_cmd = Generate_cmd(CART_OP_RDFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
+      // Get the frame, the part of it we don't write has to be read
+      // unless it is past the end of the file
+      int no_read = (filepos - fp >= oldsize) || (fp == 0 && unwritten == 1024);
+      if ((f = get_frame(cart, frame, no_read)) == NULL) return -1;
 
-      // Write to the buffer returned by CART_OP_RDFRME
-      int16_t fp = filepos % 1024; //file position within a frame
-      strncpy(cart_buf + fp, buf, unwritten);
+      // Write to the cached frame, it goes to the cart later
+      strncpy(f->data + fp, buf, unwritten);
       assert(unwritten == strlen(buf));
-
-      // Update the frame
-      sent_cmd = Generate_cmd(CART_OP_WRFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
+      f->dirty = 1;
       
       filepos += unwritten; 
       unwritten = 0;
     }
     else {  // when need to write more than one frame
       int32_t frame = (filepos / 1024) + (VnodeTable[fd].used_carts)[1];
-      
-      // Read the frame
-      sent_cmd = Generate_cmd(CART_OP_RDFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
-
-      // Write to the buffer returned by CART_OP_RDFRME
       int16_t fp = filepos % 1024; //file position within a frame
-      strncpy(cart_buf + fp, buf, 1024 - fp);
-      assert(strlen(cart_buf) == 1024);
+      
+      // Get the frame, read unless it is written from its start
+      // or past the end of the file
+      int no_read = (filepos - fp >= oldsize) || (fp == 0);
+      if ((f = get_frame(cart, frame, no_read)) == NULL) return -1;
 
-      // Update the frame
-      sent_cmd = Generate_cmd(CART_OP_WRFRME, 0, frame);
-      return_cmd = cart_io_bus(sent_cmd, cart_buf);
-      if (getRT(return_cmd) != 0) return -1; 
+      // Write to the cached frame, it goes to the cart later
+      strncpy(f->data + fp, buf, 1024 - fp);
+      assert(strlen(f->data) == 1024);
+      f->dirty = 1;
 
       // Update variables
       filepos += 1024 - fp;
@@ -382,6 +465,7 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count) {
   // Update file_pos & file_size
   VnodeTable[fd].file_pos = filepos;
   VnodeTable[fd].file_size = filesize; 
+  bytes_moved += count;
 
   // Return successfully
   return (count);
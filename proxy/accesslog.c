@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include "accesslog.h"
+#include "metrics.h"
+
+/*
+ * Asynchronous access log, turned on with "proxy -l file". Workers put
+ * a fixed size record in a ring without taking a lock or making a
+ * system call, and one writer thread takes them out in order and writes
+ * them with buffered stdio. A worker finding the ring full drops its
+ * record and counts it, requests are never held up by the log. The
+ * buffer is flushed before a line could overflow it, so every write
+ * holds whole lines, and the processes of "proxy -j" can append to the
+ * same file without cutting into each other's lines.
+ *
+ * The ring is a bounded queue of slots with sequence numbers: a slot
+ * whose seq equals the position a worker claims is free for that
+ * position, and it holds the record of position pos once seq is pos+1.
+ */
+
+typedef struct {
+  unsigned long seq;
+  struct timeval when;
+  int status;
+  const char *result;   // a string constant
+  size_t bytes;
+  long us;
+  char uri[ACCESSLOG_URI];
+} log_record;
+
+static log_record *ring;           // NULL while there is no log
+static unsigned long head;         // next position a worker claims
+static FILE *log_file;
+
+static void *writer(void *vargp);
+
+
+/* accesslog_open starts logging every request to the file at path,
+ * appending. Return 0 if succeed, otherwise return -1 */
+int accesslog_open(const char *path) {
+  pthread_t tid;
+  if ((log_file = fopen(path, "a")) == NULL) return -1;
+  setvbuf(log_file, NULL, _IOFBF, ACCESSLOG_BUF);
+
+  log_record *r = calloc(ACCESSLOG_SLOTS, sizeof(log_record));
+  if (r == NULL) return -1;
+  unsigned long i;
+  for (i = 0; i < ACCESSLOG_SLOTS; i++) r[i].seq = i;
+  __atomic_store_n(&ring, r, __ATOMIC_RELEASE);
+
+  if (pthread_create(&tid, NULL, writer, NULL)) return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+
+/* accesslog_add logs one request: its url, status code, how the cache
+ * answered it, the bytes sent and how long it took. */
+void accesslog_add(const char *uri, int status, const char *result, size_t bytes, long us) {
+  log_record *r = __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+  if (r == NULL) return;
+
+  // claim a position whose slot the writer has emptied
+  unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  log_record *slot;
+  while (1) {
+    slot = &r[pos & (ACCESSLOG_SLOTS - 1)];
+    long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff < 0) {   // a lap behind, the ring is full
+      METRIC_ADD(log_dropped, 1);
+      return;
+    }
+    if (diff == 0 && __atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+    if (diff > 0) pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+  }
+
+  gettimeofday(&slot->when, NULL);
+  slot->status = status;
+  slot->result = result;
+  slot->bytes = bytes;
+  slot->us = us;
+  strncpy(slot->uri, uri, ACCESSLOG_URI - 1);
+  slot->uri[ACCESSLOG_URI - 1] = '\0';
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+
+// take the records out of the ring in order and write them, a line
+// each: time, result, status, bytes, microseconds, url
+static void *writer(void *vargp) {
+  unsigned long tail = 0;
+  struct timespec pause = { 0, ACCESSLOG_FLUSH_MS * 1000000L };
+  char stamp[32];
+  size_t buffered = 0;   // bytes in the stdio buffer
+
+  while (1) {
+    log_record *slot = &ring[tail & (ACCESSLOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+      fflush(log_file);
+      buffered = 0;
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    if (buffered + ACCESSLOG_LINE > ACCESSLOG_BUF) {
+      fflush(log_file);
+      buffered = 0;
+    }
+    struct tm tm;
+    gmtime_r(&slot->when.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+    int n = fprintf(log_file, "%s.%06ldZ %s %d %zu %ld %s\n", stamp, (long)slot->when.tv_usec,
+                    slot->result, slot->status, slot->bytes, slot->us, slot->uri);
+    if (n > 0) buffered += n;
+
+    // hand the slot back to the workers, for the position a lap later
+    __atomic_store_n(&slot->seq, tail + ACCESSLOG_SLOTS, __ATOMIC_RELEASE);
+    tail++;
+  }
+  return NULL;
+}
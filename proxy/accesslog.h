@@ -0,0 +1,15 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stddef.h>
+
+#define ACCESSLOG_SLOTS 4096      // records the ring holds, a power of two
+#define ACCESSLOG_URI 240         // bytes of the url kept in a record
+#define ACCESSLOG_FLUSH_MS 50     // how often the writer looks at the ring
+#define ACCESSLOG_BUF (64 * 1024) // stdio buffer of the log file
+#define ACCESSLOG_LINE (ACCESSLOG_URI + 128)   // longest line of a record
+
+int accesslog_open(const char *path);
+void accesslog_add(const char *uri, int status, const char *result, size_t bytes, long us);
+
+#endif /* __ACCESSLOG_H__ */
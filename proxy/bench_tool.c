@@ -0,0 +1,452 @@
+/*
+ * bench_tool - load the proxy with a mix of requests and report its
+ * throughput, latency percentiles, hit ratio and memory.
+ *
+ *   usage: bench_tool [-c clients] [-n requests] [-k objects] [-s skew]
+ *                     [-h hit ratio] [-m size:weight,...] [-d delay ms]
+ *                     [-D] [-P proxy port] [-R min req/s] [-L max p99 us]
+ *                     [proxy command ...]
+ *
+ * Serves the objects itself, from an origin on a free local port, and
+ * starts the proxy command if one is given (listening on the -P port),
+ * or else loads a proxy that is already running there. A share of the
+ * requests set by -h goes to k cacheable objects, picked with a Zipf
+ * distribution of exponent -s; the others go to objects the origin
+ * marks no-store, so they are fetched every time. Object sizes follow
+ * the -m weights. With -d the origin waits that long before every
+ * answer, like a distant server, which is what a proxy worker spends
+ * most of a miss blocked on. Every object is requested once before the
+ * timing starts, and the hit ratio is read from the proxy's /metrics.
+ * -D sends the same requests straight to the origin instead, for a
+ * baseline to hold the proxy's numbers against. The exit status is 1 if
+ * any request failed, the throughput fell below -R or the p99 latency
+ * went past -L, so that a script can tell a regression.
+ *
+ * Build it with csapp.c and -lm; it is not part of the proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+
+#define MAX_MIX 16           // entries of -m
+#define DEFAULT_MIX "1024:60,8192:30,65536:9,524288:1"
+#define BODY_CHUNK 65536     // the origin writes bodies this much at a time
+#define START_WAIT 5000      // ms to wait for the proxy to listen
+
+typedef struct {
+  size_t size;
+  int weight;
+} mix_t;
+
+// one client thread
+typedef struct {
+  int id;
+  int n;                      // requests to send
+  double *lat;                // their latencies in us
+  unsigned long long bytes;   // body bytes received
+  int errors;
+} client_t;
+
+static char *proxy_port = "18081";
+static char origin_port[16];
+static int nobjects = 100;
+static double hit_ratio = 0.9;
+static int origin_delay = 0;   // ms before the origin answers
+static int direct = 0;         // load the origin itself, no proxy
+static double *zipf_cdf;
+static mix_t mix[MAX_MIX];
+static int nmix, mix_total;
+static char body[BODY_CHUNK];
+
+static void parse_mix(const char *spec);
+static size_t mix_size(unsigned long r);
+static unsigned long next_rand(unsigned long *s);
+static void *origin(void *vargp);
+static void *origin_conn(void *vargp);
+static void *client(void *vargp);
+static int fetch(rio_t *rio, int *fd, const char *url, unsigned long long *bytes);
+static pid_t start_proxy(char **cmd);
+static int wait_proxy(void);
+static int scrape(unsigned long *requests, unsigned long *hits);
+static long rss_kb(pid_t pid, const char *field);
+static int cmp_double(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+  int nclients = 8, n = 20000;
+  double skew = 0.99;
+  double min_rate = 0, max_p99 = 0;   // thresholds, 0 for none
+  const char *spec = DEFAULT_MIX;
+  int opt, i;
+
+  while ((opt = getopt(argc, argv, "+c:n:k:s:h:m:d:DP:R:L:")) != -1) {
+    switch (opt) {
+      case 'c': nclients = atoi(optarg); break;
+      case 'n': n = atoi(optarg); break;
+      case 'k': nobjects = atoi(optarg); break;
+      case 's': skew = atof(optarg); break;
+      case 'h': hit_ratio = atof(optarg); break;
+      case 'm': spec = optarg; break;
+      case 'd': origin_delay = atoi(optarg); break;
+      case 'D': direct = 1; break;
+      case 'P': proxy_port = optarg; break;
+      case 'R': min_rate = atof(optarg); break;
+      case 'L': max_p99 = atof(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-c clients] [-n requests] [-k objects] [-s skew] "
+                "[-h hit ratio] [-m size:weight,...] [-d delay ms] [-D] [-P proxy port] "
+                "[-R min req/s] [-L max p99 us] [proxy command ...]\n",
+                argv[0]);
+        exit(1);
+    }
+  }
+  if (nclients < 1 || n < nclients || nobjects < 1) app_error("bad arguments");
+  parse_mix(spec);
+  memset(body, 'x', sizeof(body));
+
+  // cumulative zipf weights of the objects, the first the most popular
+  zipf_cdf = Malloc(nobjects * sizeof(double));
+  double sum = 0;
+  for (i = 0; i < nobjects; i++) {
+    sum += 1.0 / pow(i + 1, skew);
+    zipf_cdf[i] = sum;
+  }
+  for (i = 0; i < nobjects; i++) zipf_cdf[i] /= sum;
+
+  // the origin on a port the kernel picks
+  int listenfd = open_listenfd("0");
+  if (listenfd < 0) unix_error("origin listen error");
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  getsockname(listenfd, (struct sockaddr *)&sa, &salen);
+  snprintf(origin_port, sizeof(origin_port), "%d", ntohs(sa.sin_port));
+  pthread_t tid;
+  Pthread_create(&tid, NULL, origin, (void *)(long)listenfd);
+
+  // the origin takes the absolute urls as they are
+  if (direct) proxy_port = origin_port;
+  pid_t pid = (optind < argc && !direct)? start_proxy(argv + optind):-1;
+  if (wait_proxy() < 0) {
+    fprintf(stderr, "no proxy on port %s\n", proxy_port);
+    if (pid > 0) kill(pid, SIGTERM);
+    exit(1);
+  }
+
+  // warm up with every cacheable object once
+  char url[MAXLINE];
+  unsigned long long bytes = 0;
+  rio_t rio;
+  int fd = -1;
+  for (i = 0; i < nobjects; i++) {
+    snprintf(url, MAXLINE, "http://127.0.0.1:%s/obj/%d/%zu", origin_port, i, mix_size(i * 2654435761UL));
+    fetch(&rio, &fd, url, &bytes);
+  }
+  if (fd >= 0) Close(fd);
+
+  unsigned long req0 = 0, hits0 = 0, req1 = 0, hits1 = 0;
+  int have_metrics = scrape(&req0, &hits0) == 0;
+
+  client_t *clients = Calloc(nclients, sizeof(client_t));
+  pthread_t *tids = Malloc(nclients * sizeof(pthread_t));
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < nclients; i++) {
+    clients[i].id = i;
+    clients[i].n = n / nclients + (i < n % nclients);
+    clients[i].lat = Malloc(clients[i].n * sizeof(double));
+    Pthread_create(&tids[i], NULL, client, &clients[i]);
+  }
+  for (i = 0; i < nclients; i++) pthread_join(tids[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  // all latencies together
+  double *lat = Malloc(n * sizeof(double));
+  int errors = 0, k = 0;
+  bytes = 0;
+  for (i = 0; i < nclients; i++) {
+    memcpy(lat + k, clients[i].lat, clients[i].n * sizeof(double));
+    k += clients[i].n;
+    bytes += clients[i].bytes;
+    errors += clients[i].errors;
+  }
+  qsort(lat, n, sizeof(double), cmp_double);
+
+  printf("%d requests, %d clients, %d objects, skew %.2f, target hit ratio %.0f%%\n",
+         n, nclients, nobjects, skew, 100 * hit_ratio);
+  printf("throughput  %.0f req/s  %.1f MB/s  (%d errors)\n", n / secs, bytes / secs / 1e6, errors);
+  printf("latency     p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n",
+         lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], lat[n - 1]);
+  // the scrape before the run counts as a request of its own
+  if (have_metrics && scrape(&req1, &hits1) == 0 && req1 > req0 + 1)
+    printf("hit ratio   %.2f%%\n", 100.0 * (hits1 - hits0) / (req1 - req0 - 1));
+  else
+    printf("hit ratio   n/a (no /metrics)\n");
+  if (pid > 0) {
+    printf("rss         %ld KB  (peak %ld KB)\n", rss_kb(pid, "VmRSS:"), rss_kb(pid, "VmHWM:"));
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+
+  int failed = 0;
+  if (errors > 0) {
+    printf("FAIL        %d requests failed\n", errors);
+    failed = 1;
+  }
+  if (min_rate > 0 && n / secs < min_rate) {
+    printf("FAIL        %.0f req/s, below %.0f\n", n / secs, min_rate);
+    failed = 1;
+  }
+  if (max_p99 > 0 && lat[n * 99 / 100] > max_p99) {
+    printf("FAIL        p99 %.1f us, past %.1f\n", lat[n * 99 / 100], max_p99);
+    failed = 1;
+  }
+  return failed;
+}
+
+// -m size:weight,... into mix
+static void parse_mix(const char *spec) {
+  const char *p = spec;
+  while (*p && nmix < MAX_MIX) {
+    unsigned long size;
+    int weight, used;
+    if (sscanf(p, "%lu:%d%n", &size, &weight, &used) != 2 || weight < 0)
+      app_error("bad size mix");
+    mix[nmix].size = size;
+    mix[nmix].weight = weight;
+    mix_total += weight;
+    nmix++;
+    p += used;
+    if (*p == ',') p++;
+  }
+  if (mix_total == 0) app_error("bad size mix");
+}
+
+// size of the object drawn as r
+static size_t mix_size(unsigned long r) {
+  int w = r % mix_total, i;
+  for (i = 0; w >= mix[i].weight; i++) w -= mix[i].weight;
+  return mix[i].size;
+}
+
+// xorshift64*, one state per thread
+static unsigned long next_rand(unsigned long *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717UL;
+}
+
+
+// the origin: a thread per connection
+static void *origin(void *vargp) {
+  int listenfd = (long)vargp;
+  pthread_t tid;
+
+  while (1) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) continue;
+    Pthread_create(&tid, NULL, origin_conn, (void *)(long)fd);
+  }
+  return NULL;
+}
+
+// answer /obj/<id>/<size> and /miss/<seq>/<size> with size bytes, for
+// as long as the proxy keeps the connection
+static void *origin_conn(void *vargp) {
+  int fd = (long)vargp;
+  char line[MAXLINE], path[MAXLINE], version[16], hdr[256];
+  rio_t rio;
+
+  Pthread_detach(pthread_self());
+  // headers and body go out in separate writes, which must not wait for
+  // the proxy's delayed ack on a kept connection
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  rio_readinitb(&rio, fd);
+  while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+    if (sscanf(line, "%*s %s %15s", path, version) != 2) break;
+    int keep_alive = !strcmp(version, "HTTP/1.1");
+    ssize_t n;
+    while ((n = rio_readlineb(&rio, line, MAXLINE)) > 2) {
+      if (strncasecmp(line, "connection:", 11)) continue;
+      if (strstr(line + 11, "close")) keep_alive = 0;
+      if (strstr(line + 11, "keep-alive") || strstr(line + 11, "Keep-Alive")) keep_alive = 1;
+    }
+    if (n <= 0) break;
+
+    if (origin_delay) usleep(origin_delay * 1000);
+    char *slash = strrchr(path, '/');
+    size_t size = slash? strtoul(slash + 1, NULL, 10):0;
+    int len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n"
+                       "Cache-Control: %s\r\nConnection: %s\r\n\r\n", size,
+                       strncmp(path, "/miss/", 6)? "max-age=3600":"no-store",
+                       keep_alive? "keep-alive":"close");
+    if (rio_writen(fd, hdr, len) < 0) break;
+    while (size > 0) {
+      size_t chunk = (size < sizeof(body))? size:sizeof(body);
+      if (rio_writen(fd, body, chunk) < 0) break;
+      size -= chunk;
+    }
+    if (size > 0 || !keep_alive) break;
+  }
+  Close(fd);
+  return NULL;
+}
+
+
+static void *client(void *vargp) {
+  client_t *c = vargp;
+  unsigned long seed = 0x9e3779b97f4a7c15UL * (c->id + 1);
+  char url[MAXLINE];
+  rio_t rio;
+  int fd = -1, i;
+
+  for (i = 0; i < c->n; i++) {
+    unsigned long r = next_rand(&seed);
+    double u = (r >> 11) * (1.0 / 9007199254740992.0);
+    if (u < hit_ratio) {
+      // the first object whose cumulative weight reaches a second draw
+      double z = (next_rand(&seed) >> 11) * (1.0 / 9007199254740992.0);
+      int lo = 0, hi = nobjects - 1;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < z) lo = mid + 1;
+        else hi = mid;
+      }
+      snprintf(url, MAXLINE, "http://127.0.0.1:%s/obj/%d/%zu", origin_port, lo,
+               mix_size(lo * 2654435761UL));
+    } else {
+      snprintf(url, MAXLINE, "http://127.0.0.1:%s/miss/%d.%d/%zu", origin_port, c->id, i,
+               mix_size(next_rand(&seed) >> 7));
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (fetch(&rio, &fd, url, &c->bytes) < 0) c->errors++;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->lat[i] = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+  }
+  if (fd >= 0) Close(fd);
+  return NULL;
+}
+
+// get url through the proxy on *fd, connecting first when it is -1 and
+// closing it when the proxy does. Return 0 if succeed, otherwise -1
+static int fetch(rio_t *rio, int *fd, const char *url, unsigned long long *bytes) {
+  char line[MAXLINE], buf[MAXBUF];
+  long length = -1;
+  int close_after = 0;
+  ssize_t n;
+
+  if (*fd < 0) {
+    if ((*fd = open_clientfd("127.0.0.1", proxy_port)) < 0) return -1;
+    rio_readinitb(rio, *fd);
+  }
+  n = snprintf(line, MAXLINE, "GET %s HTTP/1.1\r\nHost: 127.0.0.1:%s\r\n\r\n", url, origin_port);
+  if (rio_writen(*fd, line, n) < 0) goto fail;
+  do {
+    if ((n = rio_readlineb(rio, line, MAXLINE)) <= 0) goto fail;
+    if (!strncasecmp(line, "content-length:", 15)) length = atol(line + 15);
+    if (!strncasecmp(line, "connection:", 11) && strstr(line + 11, "close")) close_after = 1;
+  } while (n > 2);
+  if (length < 0) goto fail;
+
+  *bytes += length;
+  while (length > 0) {
+    size_t want = (length < (long)sizeof(buf))? length:sizeof(buf);
+    if ((n = rio_readnb(rio, buf, want)) <= 0) goto fail;
+    length -= n;
+  }
+  if (close_after) {
+    Close(*fd);
+    *fd = -1;
+  }
+  return 0;
+
+fail:
+  Close(*fd);
+  *fd = -1;
+  return -1;
+}
+
+
+// run the proxy command with its output thrown away, the proxy prints
+// a line per connection
+static pid_t start_proxy(char **cmd) {
+  pid_t pid = fork();
+  if (pid < 0) unix_error("fork error");
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) dup2(null, STDOUT_FILENO);
+    execvp(cmd[0], cmd);
+    fprintf(stderr, "%s: %s\n", cmd[0], strerror(errno));
+    exit(1);
+  }
+  return pid;
+}
+
+// wait until the proxy accepts connections. Return 0 if it does,
+// otherwise -1
+static int wait_proxy(void) {
+  int i;
+  for (i = 0; i < START_WAIT / 10; i++) {
+    int fd = open_clientfd("127.0.0.1", proxy_port);
+    if (fd >= 0) {
+      Close(fd);
+      return 0;
+    }
+    usleep(10000);
+  }
+  return -1;
+}
+
+// requests and cache hits the proxy counted so far, fresh or stale.
+// Return 0 if succeed, otherwise -1
+static int scrape(unsigned long *requests, unsigned long *hits) {
+  char line[MAXLINE];
+  unsigned long v;
+  rio_t rio;
+  int fd = open_clientfd("127.0.0.1", proxy_port);
+  if (fd < 0) return -1;
+
+  int len = snprintf(line, MAXLINE, "GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n");
+  rio_writen(fd, line, len);
+  rio_readinitb(&rio, fd);
+  *requests = *hits = 0;
+  int found = 0;
+  while (rio_readlineb(&rio, line, MAXLINE) > 0) {
+    if (sscanf(line, "proxy_requests_total %lu", &v) == 1) {
+      *requests = v;
+      found = 1;
+    }
+    if (sscanf(line, "proxy_cache_hits_total %lu", &v) == 1) *hits += v;
+    if (sscanf(line, "proxy_cache_stale_hits_total %lu", &v) == 1) *hits += v;
+  }
+  Close(fd);
+  return found? 0:-1;
+}
+
+// a size in KB from /proc/<pid>/status, -1 if it can't be read
+static long rss_kb(pid_t pid, const char *field) {
+  char path[64], line[256];
+  long kb = -1;
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  while (fgets(line, sizeof(line), fp))
+    if (!strncmp(line, field, strlen(field))) kb = atol(line + strlen(field));
+  fclose(fp);
+  return kb;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
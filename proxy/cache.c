@@ -3,113 +3,599 @@
 #include <string.h>
 #include "csapp.h"
 #include "cache.h"
+#include "policy.h"
+#include "fresh.h"
 
+/*
+ * The cache is split into CACHE_SHARDS shards by url hash. Each shard has
+ * its own hash index and queues kept by the eviction policy (policy.c),
+ * CLOCK unless another is chosen at startup. Under CLOCK a hit only sets
+ * the item's bit, so hits take the shard lock shared and run in parallel.
+ * The byte budget is global.
+ *
+ * Items live in a slab arena (slab.c), one chunk per item. When the
+ * arena has no chunk left for a new item, more items are evicted.
+ *
+ * With a disk tier (disk.c) attached, new items are written through to
+ * it, so a restarted proxy still has them, and evicted items are written
+ * again if the disk lost them meanwhile. A miss in memory looks there
+ * before giving up, bringing the item back into memory when found.
+ * Writes go to a disk thread with a reference to the item, so neither a
+ * request nor a shard lock waits for them; find_nowait leaves the reads
+ * to it too, for callers that must not block. Past DISK_QUEUE jobs
+ * waiting, new ones are dropped.
+ *
+ * Each item carries the time it stops being fresh (fresh.c), for the
+ * caller to revalidate it; a newer response for the url replaces it.
+ *
+ * The hash index is in the arena too. A cache made by cache_init_shared
+ * lives entirely in memory mapped shared, with locks that work across
+ * processes, so the workers forked from the process that made it all
+ * see the same items at the same addresses. Those locks are not robust:
+ * a worker that dies may hold one, or references no one will release,
+ * so the parent restarts all of them on a cache_reset_shared cache.
+ */
 
-/* cache_init initializes the input cache linked list. */
-void cache_init(CacheList *list) {
-  list->size = 0;
-  list->first = NULL;
-  list->last = NULL;
+#define INIT_BUCKETS 64   // initial size of each shard's hash index
+#define EVICT_TRIES 8     // victims evicted for a chunk before emptying a page
+#define DISK_QUEUE 256    // jobs waiting for the disk thread, a power of two
+
+/* a job of the disk thread: writing an item, held until it is written,
+ * or bringing back the url from disk */
+typedef struct {
+  CacheList *list;
+  CachedItem *item;
+  char *url;
+  int replace;        // write the item even if the disk has it
+} disk_job;
+
+static disk_job disk_queue[DISK_QUEUE];
+static unsigned long disk_head, disk_tail;   // next job to add, next to do
+static int disk_busy;                        // a job is being done
+static int disk_closing;                     // no more jobs taken
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t disk_idle = PTHREAD_COND_INITIALIZER;
+
+static void init(CacheList *list, const cache_policy *policy, int shared);
+static int insert_item(const char *URL, const char *headers, void *item, size_t size,
+                       time_t expires, CacheList *list, int admit,
+                       const CachedItem *replaces);
+static CachedItem *lookup(const char *URL, unsigned long hash, CacheList *list);
+static CachedItem *promote(const char *URL, unsigned long hash, CacheList *list);
+static void free_item(CachedItem *item, CacheList *list);
+static void put_item(CachedItem *item, CacheList *list);
+static CacheShard *shard_of(unsigned long hash, CacheList *list);
+static int evict_one(CacheShard *shard, CacheList *list, int freq);
+static int evict_any(CacheList *list, int start);
+static int evict_page(CacheList *list);
+static void evict_item(CachedItem *item, CacheShard *shard, CacheList *list);
+static void unlink_item(CachedItem *item, CacheShard *shard, CacheList *list);
+static unsigned long hash_url(const char *URL);
+static CachedItem *index_find(const char *URL, unsigned long hash, CacheShard *shard);
+static void index_insert(CachedItem *item, CacheShard *shard, CacheList *list);
+static CachedItem **index_alloc(size_t n, CacheList *list);
+static void index_remove(CachedItem *item, CacheShard *shard);
+static void disk_async(CacheList *list, CachedItem *item, const char *url, int replace);
+static void *disk_thread(void *vargp);
+
+
+/* cache_init initializes the input cache, evicting by policy, or by
+ * CLOCK if policy is NULL. */
+void cache_init(CacheList *list, const cache_policy *policy) {
+  init(list, policy, 0);
 }
 
-/* cache_URL adds a new cached item to the linked list. It takes the
- * URL being cached, a link to the content, the size of the content, and
- * the linked list being used. It creates a struct holding the metadata
- * and adds it at the beginning of the linked list.
+/* cache_init_shared makes a cache like cache_init, but in shared memory
+ * for the processes forked afterwards. Return it, or NULL. */
+CacheList *cache_init_shared(const cache_policy *policy) {
+  CacheList *list = shared_calloc(sizeof(CacheList));
+  if (list) init(list, policy, 1);
+  return list;
+}
+
+/* cache_attach_disk gives the cache a disk tier, and starts the thread
+ * doing its writes. Return 0 if succeed, otherwise return -1 */
+int cache_attach_disk(CacheList *list, disk_tier *disk) {
+  pthread_t tid;
+  list->disk = disk;
+  if (pthread_create(&tid, NULL, disk_thread, NULL)) return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+/* cache_detach_disk waits for the writes queued so far, and closes the
+ * disk tier, on the way out: no more are taken. */
+void cache_detach_disk(CacheList *list) {
+  pthread_mutex_lock(&disk_lock);
+  disk_closing = 1;
+  while (disk_head != disk_tail || disk_busy) pthread_cond_wait(&disk_idle, &disk_lock);
+  pthread_mutex_unlock(&disk_lock);
+  if (list->disk) disk_close(list->disk);
+}
+
+/* cache_URL adds a new cached item to the cache. It takes the URL being
+ * cached, a link to the content, the size of the content, and the cache
+ * being used. It creates a struct holding the metadata and hands it to
+ * the policy of the url's shard, in place of any older item cached for
+ * the url. A policy with admission drops the new item rather than evict
+ * one that was asked for as often.
  */
 void cache_URL(const char *URL, const char *headers, void *item, size_t size, CacheList *list) {
+  insert_item(URL, headers, item, size, fresh_until(headers, time(NULL)),
+              list, 1, NULL);
+}
+
+/* cache_replace caches another variant of item, fresh as long as it is,
+ * as cache_URL does, unless the item is no longer the one cached for its
+ * url by then. Return 1 if it is cached, otherwise 0 */
+int cache_replace(CachedItem *item, const char *headers, void *body, size_t size,
+                  CacheList *list) {
+  return insert_item(item->url, headers, body, size,
+                     __atomic_load_n(&item->expires, __ATOMIC_RELAXED), list, 1, item);
+}
+
+
+/* find looks the URL up in the hash index of its shard and returns a
+ * pointer to the struct associated with the requested URL. If the
+ * requested URL is not cached, in memory or on disk, it returns null.
+ * The returned item stays valid until it is handed back with
+ * cache_release, even if it is evicted meanwhile.
+ */
+CachedItem *find(const char *URL, CacheList *list) {
+  unsigned long hash = hash_url(URL);
+  if (list->sketch) sketch_add(list->sketch, hash);
+
+  CachedItem *temp = lookup(URL, hash, list);
+  if (temp == NULL && list->disk) temp = promote(URL, hash, list);
+  return temp;
+}
+
+
+/* find_nowait is find without waiting for the disk: a URL only found
+ * there is brought back in the background, for a later request. */
+CachedItem *find_nowait(const char *URL, CacheList *list) {
+  unsigned long hash = hash_url(URL);
+  if (list->sketch) sketch_add(list->sketch, hash);
+
+  CachedItem *temp = lookup(URL, hash, list);
+  if (temp == NULL && list->disk) disk_async(list, NULL, URL, 0);
+  return temp;
+}
+
+
+/* cache_release drops a reference taken by find. */
+void cache_release(CachedItem *item, CacheList *list) {
+  put_item(item, list);
+}
+
+
+/* cache_hold takes one more reference to an item found with find, to
+ * be dropped with cache_release too. */
+void cache_hold(CachedItem *item) {
+  __atomic_add_fetch(&item->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+
+/* cache_refresh makes a revalidated item fresh again, following the
+ * headers of the 304 response, or its own if those say nothing. */
+void cache_refresh(CachedItem *item, const char *headers) {
+  time_t now = time(NULL);
+  time_t expires = (fresh_lifetime(headers, 0) >= 0)? fresh_until(headers, now):
+                   now + fresh_lifetime(item->headers, 1);
+  __atomic_store_n(&item->expires, expires, __ATOMIC_RELAXED);
+}
+
+
+/* frees the memory used to store each cached object, and frees the struct
+ * used to store its metadata. */
+void cache_destruct(CacheList *list) {
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &list->shards[i];
+    CachedItem *temp;
+    while ((temp = list->policy->victim(shard)) != NULL) {
+      list->policy->remove(temp, shard);
+      free_item(temp, list);
+    }
+    slab_pin(&list->arena, shard->buckets, -1);
+    slab_free(&list->arena, shard->buckets, shard->nbuckets * sizeof(CachedItem *));
+    shard->buckets = NULL;
+    shard->count = 0;
+    pthread_rwlock_destroy(&shard->lock);
+  }
+  list->size = 0;
+  if (list->sketch && list->arena.shared) munmap(list->sketch, sizeof(freq_sketch));
+  else free(list->sketch);
+  list->sketch = NULL;
+  slab_destroy(&list->arena);
+}
+
+/* cache_reset_shared empties a shared cache once every process using it
+ * is gone. One killed midway may have left a lock held or a list half
+ * changed, so nothing is walked or unlocked: the arena and the index are
+ * thrown away and made again. The counters keep counting. */
+void cache_reset_shared(CacheList *list) {
+  const cache_policy *policy = list->policy;
+  unsigned long evictions = list->evictions, promotions = list->promotions;
+
+  if (list->sketch) munmap(list->sketch, sizeof(freq_sketch));
+  slab_destroy(&list->arena);
+  memset(list, 0, sizeof(CacheList));
+  init(list, policy, 1);
+  list->evictions = evictions;
+  list->promotions = promotions;
+}
+
+
+// set up an empty cache, shared with processes forked later if shared
+static void init(CacheList *list, const cache_policy *policy, int shared) {
+  if (slab_init(&list->arena, shared) < 0) unix_error("slab_init error");
+
+  list->size = 0;
+  list->policy = policy ? policy : &clock_policy;
+  list->sketch = NULL;
+  if (list->policy->admission)
+    list->sketch = shared ? shared_calloc(sizeof(freq_sketch)) : Calloc(1, sizeof(freq_sketch));
+  list->disk = NULL;
+  list->evictions = list->promotions = 0;
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  if (shared) pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &list->shards[i];
+    shard->hand = shard->small = NULL;
+    shard->bytes = shard->small_bytes = 0;
+    memset(shard->ghost, 0, sizeof(shard->ghost));
+    shard->ghost_next = 0;
+    shard->nbuckets = INIT_BUCKETS;
+    if ((shard->buckets = index_alloc(shard->nbuckets, list)) == NULL)
+      app_error("cache index does not fit in the arena");
+    shard->count = 0;
+    pthread_rwlock_init(&shard->lock, &attr);
+  }
+  pthread_rwlockattr_destroy(&attr);
+}
+
+/* insert_item does the work of cache_URL, for an item fresh until
+ * expires. Unless admit is set, the policy's admission is skipped and an
+ * item already cached is kept, for items coming back from disk. With
+ * replaces, the new item only takes the place of that one. Return 1 if
+ * it is cached, otherwise 0 */
+static int insert_item(const char *URL, const char *headers, void *item, size_t size,
+                       time_t expires, CacheList *list, int admit,
+                       const CachedItem *replaces) {
   if (size > MAX_OBJECT_SIZE) {
     free(item);
-    return;
+    return 0;
+  }
+
+  unsigned long hash = hash_url(URL);
+  CacheShard *home = shard_of(hash, list);
+  int start = home - list->shards;
+
+  // nothing to do if another thread brought the url back meanwhile
+  if (!admit) {
+    pthread_rwlock_rdlock(&home->lock);
+    CachedItem *dup = index_find(URL, hash, home);
+    pthread_rwlock_unlock(&home->lock);
+    if (dup) {
+      free(item);
+      return 0;
+    }
+  }
+  // reserve the space first, then evict until the budget holds again,
+  // starting with our own shard and moving on to the others. The bytes
+  // of an item replaced are as good as free already
+  int freq = admit && list->sketch ? sketch_estimate(list->sketch, hash) : -1;
+  size_t budget = MAX_CACHE_SIZE + (replaces? replaces->size:0);
+  size_t total = __atomic_add_fetch(&list->size, size, __ATOMIC_RELAXED);
+  int i, evicted = 0;
+  for (i = 0; i < CACHE_SHARDS && total > budget; i++) {
+    CacheShard *shard = &list->shards[(start + i) % CACHE_SHARDS];
+    pthread_rwlock_wrlock(&shard->lock);
+    while (total > budget && (evicted = evict_one(shard, list, freq)) > 0)
+      total = __atomic_load_n(&list->size, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+    if (evicted < 0) {   // not popular enough to be worth a victim
+      __atomic_sub_fetch(&list->size, size, __ATOMIC_RELAXED);
+      free(item);
+      return 0;
+    }
+  }
+
+  // one chunk for the struct, url, headers and body, evicting more
+  // while the arena has none free in this size class: the policy's
+  // victims for a while, then all the items of the emptiest page
+  size_t url_len = strlen(URL) + 1;
+  size_t hdr_len = strlen(headers) + 1;
+  size_t alloc = sizeof(CachedItem) + url_len + hdr_len + size;
+  CachedItem *new_item;
+  int tries = 0;
+  while ((new_item = slab_alloc(&list->arena, alloc)) == NULL) {
+    if (++tries > EVICT_TRIES && evict_page(list)) continue;
+    if (!evict_any(list, start)) {   // too big for the arena
+      __atomic_sub_fetch(&list->size, size, __ATOMIC_RELAXED);
+      free(item);
+      return 0;
+    }
   }
 
   // construct a new CachedItem
-  CachedItem* new_item = malloc(sizeof(CachedItem));
-  new_item->url = strdup(URL);
-  new_item->headers = strdup(headers);
-  new_item->item_p = item;
+  new_item->url = (char *)(new_item + 1);
+  new_item->headers = new_item->url + url_len;
+  new_item->item_p = new_item->headers + hdr_len;
+  memcpy(new_item->url, URL, url_len);
+  memcpy(new_item->headers, headers, hdr_len);
+  memcpy(new_item->item_p, item, size);
+  free(item);
+  new_item->hdr_len = hdr_len - 1;
   new_item->size = size;
-  new_item->prev = new_item->next = NULL;
-
-  // make sure there are enough space for new node
-  while (list->size + size > MAX_CACHE_SIZE) {
-    // delete the last node
-    list->size -= list->last->size;
-
-    CachedItem* temp_last = list->last;
-    list->last = list->last->prev;
-    list->last->next = NULL;
-    free(temp_last->url);
-    free(temp_last->headers);
-    free(temp_last->item_p);
-    free(temp_last);
+  new_item->alloc = alloc;
+  new_item->body_fd = list->arena.fd;
+  new_item->body_off = (char *)new_item->item_p - list->arena.base;
+  new_item->refcnt = 1;   // the reference held by the cache
+  new_item->expires = expires;
+  new_item->swr = fresh_swr(headers);
+  new_item->gzip = gzip_encoded(headers);
+  new_item->revalidating = 0;
+  new_item->freq = 0;
+  new_item->queue = 0;
+  new_item->hash = hash;
+  new_item->prev = new_item->next = new_item->hnext = NULL;
+
+  pthread_rwlock_wrlock(&home->lock);
+
+  // check again, now for good
+  CachedItem *old = index_find(URL, hash, home);
+  if ((old && !admit) || (replaces && old != replaces)) {
+    pthread_rwlock_unlock(&home->lock);
+    __atomic_sub_fetch(&list->size, size, __ATOMIC_RELAXED);
+    free_item(new_item, list);
+    return 0;
   }
+  if (old) unlink_item(old, home, list);
+
+  home->bytes += size;
+  list->policy->insert(new_item, home);
+  index_insert(new_item, home, list);
+  if (admit && list->disk) disk_async(list, new_item, NULL, 1);
+  pthread_rwlock_unlock(&home->lock);
+  return 1;
+}
 
-  // insert the new node
-  if (list->first != NULL) {
-    new_item->next = list->first;
-    list->first->prev = new_item;
-    list->first = new_item;
-  } else {
-    list->first = new_item;
-    list->last = new_item;
+
+// return the item cached in memory under URL, pinned
+static CachedItem *lookup(const char *URL, unsigned long hash, CacheList *list) {
+  CacheShard *shard = shard_of(hash, list);
+
+  if (list->policy->exclusive_hits)
+    pthread_rwlock_wrlock(&shard->lock);
+  else
+    pthread_rwlock_rdlock(&shard->lock);
+  CachedItem *temp = index_find(URL, hash, shard);
+  if (temp) {
+    list->policy->hit(temp, shard);
+    __atomic_add_fetch(&temp->refcnt, 1, __ATOMIC_RELAXED);
   }
+  pthread_rwlock_unlock(&shard->lock);
 
-  list->size += size;
+  return temp;
 }
 
+// bring the item back from the disk tier, as fresh as it was when it
+// went there, and return it pinned
+static CachedItem *promote(const char *URL, unsigned long hash, CacheList *list) {
+  char *headers;
+  void *body;
+  size_t size;
+  time_t expires;
 
-/* find iterates through the linked list and returns a pointer to the
- * struct associated with the requested URL. If the requested URL is
- * not cached, it returns null.
- */
-CachedItem *find(const char *URL, CacheList *list) {
-  // try to find the url first
-  CachedItem *temp = list->first;
-  while(temp) {
-    if (!strcmp(temp->url, URL)) break;
-    temp = temp->next;
+  if (!disk_get(list->disk, hash, URL, &headers, &body, &size, &expires)) return NULL;
+  insert_item(URL, headers, body, size, expires, list, 0, NULL);
+  free(headers);
+  __atomic_add_fetch(&list->promotions, 1, __ATOMIC_RELAXED);
+  return lookup(URL, hash, list);
+}
+
+
+// free a single item together with everything it owns
+static void free_item(CachedItem *item, CacheList *list) {
+  slab_free(&list->arena, item, item->alloc);
+}
+
+// drop one reference, the last one frees the item
+static void put_item(CachedItem *item, CacheList *list) {
+  if (__atomic_sub_fetch(&item->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+    free_item(item, list);
+}
+
+// pick the shard by the high bits, the buckets use the low ones
+static CacheShard *shard_of(unsigned long hash, CacheList *list) {
+  return &list->shards[(hash >> 56) % CACHE_SHARDS];
+}
+
+/* evict_one evicts the victim the policy picks in the shard, moving it
+ * to the disk tier if there is one. If freq is not negative, the victim
+ * is kept when it was seen freq times or more. The caller holds the
+ * shard lock exclusively. Return 1 if an item was evicted, 0 if the
+ * shard is empty, -1 if the victim was kept. */
+static int evict_one(CacheShard *shard, CacheList *list, int freq) {
+  CachedItem *temp = list->policy->victim(shard);
+  if (temp == NULL) return 0;
+  if (freq >= 0 && sketch_estimate(list->sketch, temp->hash) >= freq) return -1;
+
+  evict_item(temp, shard, list);
+  return 1;
+}
+
+// evict the item, moving it to the disk tier if there is one. The
+// caller holds the shard lock exclusively
+static void evict_item(CachedItem *item, CacheShard *shard, CacheList *list) {
+  if (list->disk) disk_async(list, item, NULL, 0);
+  unlink_item(item, shard, list);
+  __atomic_add_fetch(&list->evictions, 1, __ATOMIC_RELAXED);
+}
+
+// take the item out of the cache, the caller holds the shard lock
+// exclusively
+static void unlink_item(CachedItem *item, CacheShard *shard, CacheList *list) {
+  list->policy->remove(item, shard);
+  index_remove(item, shard);
+  shard->bytes -= item->size;
+  __atomic_sub_fetch(&list->size, item->size, __ATOMIC_RELAXED);
+  put_item(item, list);   // readers still holding it free it on release
+}
+
+// evict one item from any shard, starting at shard start.
+// Return 1 if an item was evicted, 0 if the cache is empty
+static int evict_any(CacheList *list, int start) {
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &list->shards[(start + i) % CACHE_SHARDS];
+    pthread_rwlock_wrlock(&shard->lock);
+    int evicted = evict_one(shard, list, -1);
+    pthread_rwlock_unlock(&shard->lock);
+    if (evicted) return 1;
   }
+  return 0;
+}
 
-  if (temp == NULL) return NULL; // nothing found
+// evict every item in the page slab_sparse_page picks, which comes free
+// for another size class once the readers still holding some of them
+// are done. Return the number of items evicted
+static int evict_page(CacheList *list) {
+  char *page = slab_sparse_page(&list->arena);
+  if (page == NULL) return 0;
 
-  // take it away from middle
-  if (temp->prev) temp->prev->next = temp->next;
-  if (temp->next) temp->next->prev = temp->prev;
+  int i, n = 0;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    CacheShard *shard = &list->shards[i];
+    pthread_rwlock_wrlock(&shard->lock);
+    size_t b;
+    for (b = 0; b < shard->nbuckets; b++) {
+      CachedItem *temp = shard->buckets[b], *next;
+      for (; temp; temp = next) {
+        next = temp->hnext;
+        if ((char *)temp < page || (char *)temp >= page + SLAB_PAGE_SIZE) continue;
+        evict_item(temp, shard, list);
+        n++;
+      }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  return n;
+}
 
-  if (temp == list->first) list->first = temp->next;
-  if (temp == list->last) list->last = temp->prev;
+// FNV-1a hash of a url
+static unsigned long hash_url(const char *URL) {
+  unsigned long hash = 14695981039346656037UL;
+  for (; *URL; URL++) {
+    hash ^= (unsigned char)*URL;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
 
-  temp->next = temp->prev = NULL;
+// return the item cached under URL, the caller holds the shard lock
+static CachedItem *index_find(const char *URL, unsigned long hash, CacheShard *shard) {
+  CachedItem *temp = shard->buckets[hash & (shard->nbuckets - 1)];
+  for (; temp; temp = temp->hnext) {
+    if (temp->hash == hash && !strcmp(temp->url, URL)) return temp;
+  }
+  return NULL;
+}
 
-  // insert it to the front
-  if (list->first != NULL) {
-    temp->next = list->first;
-    list->first->prev = temp;
-    list->first = temp;
-  } else {
-    list->first = temp;
-    list->last = temp;
+// add the item to the hash index, doubling the buckets once the
+// index is fuller than one item per bucket. The chains just grow
+// longer when the arena has no room for twice the buckets.
+static void index_insert(CachedItem *item, CacheShard *shard, CacheList *list) {
+  CachedItem **buckets;
+  if (shard->count + 1 > shard->nbuckets &&
+      (buckets = index_alloc(shard->nbuckets * 2, list)) != NULL) {
+    size_t n = shard->nbuckets * 2;
+    size_t i;
+    for (i = 0; i < shard->nbuckets; i++) {
+      CachedItem *temp = shard->buckets[i];
+      while (temp) {
+        CachedItem *next = temp->hnext;
+        temp->hnext = buckets[temp->hash & (n - 1)];
+        buckets[temp->hash & (n - 1)] = temp;
+        temp = next;
+      }
+    }
+    slab_pin(&list->arena, shard->buckets, -1);
+    slab_free(&list->arena, shard->buckets, shard->nbuckets * sizeof(CachedItem *));
+    shard->buckets = buckets;
+    shard->nbuckets = n;
   }
 
-  return temp;
+  CachedItem **head = &shard->buckets[item->hash & (shard->nbuckets - 1)];
+  item->hnext = *head;
+  *head = item;
+  shard->count++;
 }
 
+// take the item out of the hash index
+static void index_remove(CachedItem *item, CacheShard *shard) {
+  CachedItem **pp = &shard->buckets[item->hash & (shard->nbuckets - 1)];
+  while (*pp != item) pp = &(*pp)->hnext;
+  *pp = item->hnext;
+  item->hnext = NULL;
+  shard->count--;
+}
 
-/* frees the memory used to store each cached object, and frees the struct
- * used to store its metadata. */
-void cache_destruct(CacheList *list) {
-  CachedItem *temp = list->first;
-  while (temp) {
-    free(temp->url);
-    free(temp->headers);
-    free(temp->item_p);
-    if (temp->next) {
-      temp = temp->next;
-      free(temp->prev);
-    } else {
-      free(temp);
-      break;
+// n empty buckets from the arena, or NULL
+static CachedItem **index_alloc(size_t n, CacheList *list) {
+  CachedItem **buckets = slab_alloc(&list->arena, n * sizeof(CachedItem *));
+  if (buckets == NULL) return NULL;
+  memset(buckets, 0, n * sizeof(CachedItem *));
+  slab_pin(&list->arena, buckets, 1);   // never evicted with a page
+  return buckets;
+}
+
+// queue a job for the disk thread: writing item, which is held until it
+// is written, or else bringing url back. The caller holds a reference
+// to item, or the lock of its shard
+static void disk_async(CacheList *list, CachedItem *item, const char *url, int replace) {
+  pthread_mutex_lock(&disk_lock);
+  if (!disk_closing && disk_head - disk_tail < DISK_QUEUE) {
+    if (item) cache_hold(item);
+    disk_queue[disk_head++ & (DISK_QUEUE - 1)] =
+      (disk_job){ list, item, item? NULL:strdup(url), replace };
+    pthread_cond_signal(&disk_ready);
+  }
+  pthread_mutex_unlock(&disk_lock);
+}
+
+// do the queued disk jobs one after another, for as long as we run
+static void *disk_thread(void *vargp) {
+  (void)vargp;
+  while (1) {
+    pthread_mutex_lock(&disk_lock);
+    while (disk_head == disk_tail) pthread_cond_wait(&disk_ready, &disk_lock);
+    disk_job job = disk_queue[disk_tail++ & (DISK_QUEUE - 1)];
+    disk_busy = 1;
+    pthread_mutex_unlock(&disk_lock);
+
+    CachedItem *item = job.item;
+    if (item) {
+      disk_put(job.list->disk, item->hash, item->url, item->headers, item->item_p,
+               item->size, __atomic_load_n(&item->expires, __ATOMIC_RELAXED),
+               job.replace);
+      put_item(item, job.list);
+    } else if (job.url) {
+      CachedItem *found = promote(job.url, hash_url(job.url), job.list);
+      if (found) put_item(found, job.list);
+      free(job.url);
     }
+
+    pthread_mutex_lock(&disk_lock);
+    disk_busy = 0;
+    if (disk_head == disk_tail) pthread_cond_broadcast(&disk_idle);
+    pthread_mutex_unlock(&disk_lock);
   }
+  return NULL;
 }
@@ -0,0 +1,87 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+#include "slab.h"
+#include "disk.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+#define CACHE_SHARDS 16   // independently locked parts of the cache
+#define GHOST_ENTRIES 128 // evicted urls remembered per shard by S3-FIFO
+
+typedef struct cache_policy cache_policy;
+typedef struct freq_sketch freq_sketch;
+
+/* one cached web object, kept in a queue of its shard by the eviction
+ * policy. The url, headers and body follow the struct in the same slab
+ * chunk. */
+typedef struct CachedItem {
+  char *url;                  // key of the cached object
+  char *headers;              // response headers, including the empty line
+  size_t hdr_len;             // strlen(headers)
+  void *item_p;               // response body
+  size_t size;                // size of the body in bytes
+  size_t alloc;               // size of the chunk holding all of it
+  int body_fd;                // memfd of the arena holding the body
+  off_t body_off;             // offset of the body in body_fd
+  int refcnt;                 // references held by the list and by readers
+  time_t expires;             // fresh until then, revalidated afterwards
+  int swr;                    // seconds it may be served stale while it is
+                              // revalidated, -1 if the origin did not say
+  int revalidating;           // a revalidation is on its way
+  int gzip;                   // body is gzip-encoded, inflated for clients
+                              // that don't take it
+  int freq;                   // hits counted by the policy, capped
+  int queue;                  // queue of the shard the item is in
+  unsigned long hash;         // hash of url
+  struct CachedItem *prev;
+  struct CachedItem *next;
+  struct CachedItem *hnext;   // next item in the same hash bucket
+} CachedItem;
+
+typedef struct {
+  CachedItem *hand;           // oldest item of the main queue
+  CachedItem *small;          // oldest item of the S3-FIFO probation queue
+  size_t bytes;               // bytes of bodies cached in the shard
+  size_t small_bytes;         // bytes of bodies in the probation queue
+  unsigned long ghost[GHOST_ENTRIES];   // hashes recently evicted from it
+  int ghost_next;
+  CachedItem **buckets;       // hash index on url, chained through hnext
+  size_t nbuckets;            // always a power of two
+  size_t count;               // number of cached items
+  pthread_rwlock_t lock;      // hits take it shared, changes exclusive
+} CacheShard;
+
+typedef struct {
+  size_t size;                // total bytes of cached bodies, atomic
+  CacheShard shards[CACHE_SHARDS];
+  slab_arena arena;           // memory of every cached item
+  const cache_policy *policy; // how the shards pick their victims
+  freq_sketch *sketch;        // access counts, when the policy admits by them
+  disk_tier *disk;            // where evicted items go, or NULL
+  unsigned long evictions;    // items evicted so far, atomic
+  unsigned long promotions;   // items brought back from disk, atomic
+} CacheList;
+
+void cache_init(CacheList *list, const cache_policy *policy);
+CacheList *cache_init_shared(const cache_policy *policy);
+void cache_URL(const char *URL, const char *headers, void *item, size_t size, CacheList *list);
+CachedItem *find(const char *URL, CacheList *list);
+CachedItem *find_nowait(const char *URL, CacheList *list);
+int cache_replace(CachedItem *item, const char *headers, void *body, size_t size,
+                  CacheList *list);
+void cache_release(CachedItem *item, CacheList *list);
+void cache_hold(CachedItem *item);
+void cache_refresh(CachedItem *item, const char *headers);
+void cache_destruct(CacheList *list);
+void cache_reset_shared(CacheList *list);
+int cache_attach_disk(CacheList *list, disk_tier *disk);
+void cache_detach_disk(CacheList *list);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "csapp.h"
+#include "compress.h"
+#include "fresh.h"
+#include "metrics.h"
+
+/*
+ * Gzip variants of cached objects, turned on with "proxy -z". The two
+ * variants of a url are cached apart, the plain one under the url and
+ * the gzipped one under the url and "\tgzip" (variant_key), and clients
+ * are served the one they accept: those taking gzip the gzipped one, or
+ * else the plain one, the others only the plain one, and a miss if there
+ * is none. An object of a compressible type is queued for a compressor
+ * thread when a client taking gzip fetches it or hits its plain
+ * variant, which caches its gzip encoding beside it if that saves an
+ * eighth of it or more. Nothing is inflated or rewritten on the way to
+ * a client. An object the origin sent gzipped itself is cached as the
+ * gzip variant, which works without -z too.
+ *
+ * The client's Accept-Encoding is not passed on as it is: the proxy asks
+ * for gzip when the client takes it, and for nothing else, so a cached
+ * object is gzipped or plain and can be served to anyone taking that
+ * variant. Responses
+ * varying on other request headers are not cached (resp_header).
+ */
+
+static CacheList *cache;           // where compressed objects go
+static char *queue[COMPRESS_QUEUE];
+static unsigned long head, tail;   // next slot to fill, next to empty
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+static void *compressor(void *vargp);
+static void compress_url(const char *url);
+static long gzip(const char *in, size_t len, char *out, size_t cap);
+static char *gzip_headers(const char *hdrs, size_t body_len);
+static int compressible(const char *hdrs, size_t size);
+static int q_zero(const char *p, const char *end);
+
+
+/* compress_start starts the compressor thread, which caches the gzip
+ * variants in list. Return 0 if succeed, otherwise return -1 */
+int compress_start(CacheList *list) {
+  pthread_t tid;
+  cache = list;
+  if (pthread_create(&tid, NULL, compressor, NULL)) return -1;
+  pthread_detach(tid);
+  return 0;
+}
+
+
+/* compress_async queues url, cached plain with headers and a body of
+ * size bytes, to get a gzip variant if it is worth it. Nothing is queued
+ * while the compressor is off or has too much to do. */
+void compress_async(const char *url, const char *headers, size_t size) {
+  if (cache == NULL || !compressible(headers, size)) return;
+  pthread_mutex_lock(&lock);
+  if (head - tail < COMPRESS_QUEUE) {
+    queue[head++ & (COMPRESS_QUEUE - 1)] = strdup(url);
+    pthread_cond_signal(&ready);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+
+/* accepts_gzip returns 1 if the request r takes gzip-encoded bodies:
+ * its Accept-Encoding names gzip, or "*" without refusing gzip, with a
+ * q value above zero. */
+int accepts_gzip(const http_request *r) {
+  int gz = 0, any = 0;   // 1 accepted, -1 refused, 0 not named
+  int i;
+  for (i = 0; i < r->nheaders; i++) {
+    if (r->headers[i].id != HDR_ACCEPT_ENCODING) continue;
+    const char *p = r->headers[i].value.p, *end = p + r->headers[i].value.len;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+      const char *start = p;
+      while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+      size_t len = p - start;
+
+      // the parameters, of which only q counts
+      int ok = 1;
+      while (p < end && *p != ',') {
+        if ((*p == 'q' || *p == 'Q') && p + 1 < end && p[1] == '=' &&
+            (p[-1] == ';' || p[-1] == ' ' || p[-1] == '\t')) {
+          const char *v = p + 2;
+          while (p < end && *p != ',' && *p != ';') p++;
+          ok = !q_zero(v, p);
+          continue;
+        }
+        p++;
+      }
+      if ((len == 4 && !strncasecmp(start, "gzip", 4)) ||
+          (len == 6 && !strncasecmp(start, "x-gzip", 6)))
+        gz = ok? 1:-1;
+      else if (len == 1 && *start == '*')
+        any = ok? 1:-1;
+    }
+  }
+  return gz? gz > 0:any > 0;
+}
+
+
+/* variant_key writes the cache key of url's variant with a gzipped body,
+ * or a plain one, into key, of at least MAXLINE + 8 bytes. Return key */
+char *variant_key(char *key, const char *url, int gzip) {
+  sprintf(key, "%s%s", url, gzip? "\tgzip":"");
+  return key;
+}
+
+
+// compress the queued urls one after another, for as long as we run
+static void *compressor(void *vargp) {
+  (void)vargp;
+  while (1) {
+    pthread_mutex_lock(&lock);
+    while (head == tail) pthread_cond_wait(&ready, &lock);
+    char *url = queue[tail++ & (COMPRESS_QUEUE - 1)];
+    pthread_mutex_unlock(&lock);
+
+    if (url) compress_url(url);
+    free(url);
+  }
+  return NULL;
+}
+
+// cache the gzip variant of the plain item cached for url beside it,
+// unless there is one already or it does not shrink enough
+static void compress_url(const char *url) {
+  char key[MAXLINE + 8];
+  CachedItem *item = find(variant_key(key, url, 1), cache);
+  if (item) {
+    cache_release(item, cache);
+    return;
+  }
+  if ((item = find(url, cache)) == NULL) return;
+  if (item->gzip || !compressible(item->headers, item->size)) {
+    cache_release(item, cache);
+    return;
+  }
+
+  size_t cap = compressBound(item->size) + 32;   // and the gzip wrapper
+  char *body = Malloc(cap);
+  long n = gzip(item->item_p, item->size, body, cap);
+  if (n < 0 || (size_t)n > item->size - item->size / 8) {
+    free(body);
+    cache_release(item, cache);
+    return;
+  }
+
+  char *hdrs = gzip_headers(item->headers, n);
+  cache_URL(key, hdrs, body, n, cache);
+  METRIC_ADD(compressed, 1);
+  METRIC_ADD(compress_saved, item->size - n);
+  free(hdrs);
+  cache_release(item, cache);
+}
+
+// gzip len bytes of in into out. Return the length, or -1 if it does
+// not fit in cap
+static long gzip(const char *in, size_t len, char *out, size_t cap) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  zs.next_in = (unsigned char *)in;
+  zs.avail_in = len;
+  zs.next_out = (unsigned char *)out;
+  zs.avail_out = cap;
+  int rc = deflate(&zs, Z_FINISH);
+  long n = zs.total_out;
+  deflateEnd(&zs);
+  return (rc == Z_STREAM_END)? n:-1;
+}
+
+// the headers of the gzip variant: the length is that of the encoded
+// body, and a strong etag becomes weak, the bytes are not those it names
+static char *gzip_headers(const char *hdrs, size_t body_len) {
+  size_t left = strlen(hdrs);
+  char *out = Malloc(left + 128);
+  char *p = out;
+  int vary = 0;
+  http_header h;
+
+  while (*hdrs && *hdrs != '\r' && *hdrs != '\n') {
+    size_t n = http_parse_header(hdrs, left, &h);
+    if (n == 0) {   // a last line without its line end
+      n = left;
+      h.id = HDR_OTHER;
+    }
+    if (h.id == HDR_ETAG && h.value.len > 0 && h.value.p[0] == '"') {
+      p += sprintf(p, "ETag: W/%.*s\r\n", (int)h.value.len, h.value.p);
+    } else if (h.id != HDR_CONTENT_LENGTH) {
+      vary |= (h.id == HDR_VARY);
+      memcpy(p, hdrs, n);
+      p += n;
+    }
+    hdrs += n;
+    left -= n;
+  }
+  sprintf(p, "Content-Encoding: gzip\r\n%sContent-Length: %zu\r\n\r\n",
+          vary? "":"Vary: Accept-Encoding\r\n", body_len);
+  return out;
+}
+
+// a whole, plain body of text, or of a format made of text, which the
+// origin lets us transform
+static int compressible(const char *hdrs, size_t size) {
+  static const char *types[] = {
+    "text/", "application/json", "application/javascript", "application/xml",
+    "+xml", "+json", NULL
+  };
+  char val[256];
+  int i;
+
+  if (size < COMPRESS_MIN) return 0;
+  if (header_value(hdrs, "content-encoding", val, sizeof(val)) ||
+      header_value(hdrs, "content-range", val, sizeof(val)))
+    return 0;
+  if (header_value(hdrs, "cache-control", val, sizeof(val))) {
+    for (i = 0; val[i]; i++) val[i] = tolower((unsigned char)val[i]);
+    if (strstr(val, "no-transform")) return 0;
+  }
+  if (!header_value(hdrs, "content-type", val, sizeof(val))) return 0;
+  for (i = 0; val[i]; i++) val[i] = tolower((unsigned char)val[i]);
+  char *semi = strchr(val, ';');
+  if (semi) *semi = '\0';
+  for (i = 0; types[i]; i++) {
+    if (types[i][0] == '+' && strstr(val, types[i])) return 1;
+    if (types[i][0] != '+' && !strncmp(val, types[i], strlen(types[i]))) return 1;
+  }
+  return 0;
+}
+
+// a q value of zero, "0" or "0.000" and the like
+static int q_zero(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  for (; p < end && *p != ' ' && *p != '\t'; p++)
+    if (*p != '0' && *p != '.') return 0;
+  return 1;
+}
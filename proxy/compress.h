@@ -0,0 +1,17 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+#include "cache.h"
+#include "http.h"
+
+#define COMPRESS_MIN 256           // smaller bodies are not worth compressing
+#define COMPRESS_QUEUE 256         // urls waiting for the compressor, a power of two
+#define COMPRESS_LEVEL 6           // zlib level, speed over the last few bytes
+
+int compress_start(CacheList *cache);
+void compress_async(const char *url, const char *headers, size_t size);
+int accepts_gzip(const http_request *r);
+char *variant_key(char *key, const char *url, int gzip);
+
+#endif /* __COMPRESS_H__ */
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "disk.h"
+
+/*
+ * Disk tier under the in-memory cache. Objects are written through to it
+ * as they are cached, and again when evicted if the log lost them. They
+ * are appended to a log file used as a ring of DISK_LOG_SIZE bytes, and
+ * found again through a hash index in a second file that is mapped
+ * shared, so a restarted proxy only has to map it to serve everything
+ * the last one wrote. Nothing is ever deleted: a record is gone once the
+ * log wraps over it, which the index notices by comparing positions.
+ *
+ * The end of the log is advanced before a record is written and checked
+ * again after one is read, so a reader racing with the writer that wraps
+ * over its record throws the copy away. Every record carries a checksum
+ * against what a crash left half written.
+ */
+
+#define DISK_MAGIC "pxydisk2"
+#define RECORD_MAGIC 0x70787972
+#define CHECKSUM_INIT 14695981039346656037UL
+
+/* start of every record, the url, headers and body follow */
+typedef struct {
+  uint32_t magic;
+  uint32_t url_len;
+  uint32_t hdr_len;
+  uint32_t size;
+  uint64_t hash;
+  int64_t expires;    // when the object stops being fresh
+  uint64_t sum;       // checksum of the url, headers and body
+} disk_record;
+
+static int open_index(disk_tier *d, const char *path);
+static int slot_valid(disk_tier *d, disk_slot *s);
+static disk_slot *slot_find(disk_tier *d, unsigned long hash);
+static uint64_t checksum(uint64_t sum, const void *p, size_t len);
+
+
+/* disk_open opens the log and index in dir, creating them if needed.
+ * An index that does not match the compiled sizes starts over empty.
+ * Return 0 if succeed, otherwise return -1 */
+int disk_open(disk_tier *d, const char *dir) {
+  char path[MAXLINE];
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+  snprintf(path, MAXLINE, "%s/log", dir);
+  if ((d->log_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+  snprintf(path, MAXLINE, "%s/index", dir);
+  if (open_index(d, path) < 0) {
+    close(d->log_fd);
+    return -1;
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  return 0;
+}
+
+
+/* disk_put appends an object to the log, fresh until expires, unless
+ * the log still holds it from earlier and replace is not set. */
+void disk_put(disk_tier *d, unsigned long hash, const char *url,
+              const char *headers, const void *body, size_t size, time_t expires,
+              int replace) {
+  disk_record rec;
+  rec.magic = RECORD_MAGIC;
+  rec.url_len = strlen(url);
+  rec.hdr_len = strlen(headers);
+  rec.size = size;
+  rec.hash = hash;
+  rec.expires = expires;
+  rec.sum = checksum(checksum(checksum(CHECKSUM_INIT, url, rec.url_len),
+                              headers, rec.hdr_len), body, size);
+  uint64_t len = sizeof(rec) + rec.url_len + rec.hdr_len + size;
+  if (len > DISK_LOG_SIZE / 4) return;
+
+  pthread_mutex_lock(&d->lock);
+  disk_slot *slot = slot_find(d, hash);
+  if (slot && !replace) {
+    pthread_mutex_unlock(&d->lock);
+    return;
+  }
+
+  // take the slot of the old copy, an empty or overwritten one, or else
+  // the oldest one
+  int i;
+  for (i = 0; i < DISK_PROBE && slot == NULL; i++) {
+    disk_slot *s = &d->slots[(hash + i) & (d->hdr->nslots - 1)];
+    if (!slot_valid(d, s)) slot = s;
+  }
+  for (i = 0; i < DISK_PROBE && slot == NULL; i++) {
+    disk_slot *s = &d->slots[(hash + i) & (d->hdr->nslots - 1)];
+    if (i == 0 || s->pos < slot->pos) slot = s;
+  }
+
+  // records never straddle the end of the ring
+  uint64_t pos = d->hdr->write_pos;
+  if (pos % DISK_LOG_SIZE + len > DISK_LOG_SIZE)
+    pos += DISK_LOG_SIZE - pos % DISK_LOG_SIZE;
+  slot->hash = 0;
+  __atomic_store_n(&d->hdr->write_pos, pos + len, __ATOMIC_RELEASE);
+
+  struct iovec iov[4] = {
+    { &rec, sizeof(rec) },
+    { (void *)url, rec.url_len },
+    { (void *)headers, rec.hdr_len },
+    { (void *)body, size },
+  };
+  if (pwritev(d->log_fd, iov, 4, pos % DISK_LOG_SIZE) == (ssize_t)len) {
+    slot->pos = pos;
+    slot->len = len;
+    slot->size = size;
+    slot->hash = hash;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+
+/* disk_get reads the object cached on disk under url into new buffers
+ * for its headers and body, which the caller frees, and when it stops
+ * being fresh. Return 1 if found, 0 if not. */
+int disk_get(disk_tier *d, unsigned long hash, const char *url,
+             char **headers, void **body, size_t *size, time_t *expires) {
+  pthread_mutex_lock(&d->lock);
+  disk_slot *slot = slot_find(d, hash);
+  disk_slot s;
+  if (slot) s = *slot;
+  pthread_mutex_unlock(&d->lock);
+  if (slot == NULL) return 0;
+
+  size_t meta_len = s.len - s.size;
+  char *meta = Malloc(meta_len + 1);
+  void *data = Malloc(s.size ? s.size : 1);
+  struct iovec iov[2] = { { meta, meta_len }, { data, s.size } };
+  ssize_t n = preadv(d->log_fd, iov, 2, s.pos % DISK_LOG_SIZE);
+
+  // the record must not have been overwritten while we read it
+  disk_record *rec = (disk_record *)meta;
+  size_t url_len = strlen(url);
+  if (n != (ssize_t)s.len || !slot_valid(d, &s) ||
+      rec->magic != RECORD_MAGIC || rec->hash != hash || rec->size != s.size ||
+      rec->url_len != url_len || sizeof(*rec) + url_len + rec->hdr_len != meta_len ||
+      memcmp(rec + 1, url, url_len) ||
+      rec->sum != checksum(checksum(checksum(CHECKSUM_INIT, rec + 1, url_len),
+                                    (char *)(rec + 1) + url_len, rec->hdr_len),
+                           data, s.size)) {
+    free(meta);
+    free(data);
+    return 0;
+  }
+
+  // hand the headers back as a string of their own
+  char *hdrs = Malloc(rec->hdr_len + 1);
+  memcpy(hdrs, (char *)(rec + 1) + url_len, rec->hdr_len);
+  hdrs[rec->hdr_len] = '\0';
+  *expires = rec->expires;
+  free(meta);
+  *headers = hdrs;
+  *body = data;
+  *size = s.size;
+  return 1;
+}
+
+
+/* disk_close writes the index back and closes the files, on the way
+ * out. The index stays mapped, so that a reader still on its way fails
+ * to read the log rather than crash. */
+void disk_close(disk_tier *d) {
+  pthread_mutex_lock(&d->lock);
+  msync(d->hdr, sizeof(disk_header) + d->hdr->nslots * sizeof(disk_slot), MS_SYNC);
+  close(d->index_fd);
+  close(d->log_fd);
+  d->index_fd = d->log_fd = -1;
+  pthread_mutex_unlock(&d->lock);
+}
+
+
+// map the index at path, starting a new one if it is missing or stale
+static int open_index(disk_tier *d, const char *path) {
+  size_t bytes = sizeof(disk_header) + DISK_INDEX_SLOTS * sizeof(disk_slot);
+  struct stat st;
+
+  if ((d->index_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+  if (fstat(d->index_fd, &st) < 0 ||
+      (st.st_size != (off_t)bytes && ftruncate(d->index_fd, bytes) < 0)) {
+    close(d->index_fd);
+    return -1;
+  }
+  d->hdr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, d->index_fd, 0);
+  if (d->hdr == MAP_FAILED) {
+    close(d->index_fd);
+    return -1;
+  }
+  d->slots = (disk_slot *)(d->hdr + 1);
+
+  if (st.st_size != (off_t)bytes || memcmp(d->hdr->magic, DISK_MAGIC, 8) ||
+      d->hdr->nslots != DISK_INDEX_SLOTS || d->hdr->log_size != DISK_LOG_SIZE) {
+    memset(d->hdr, 0, bytes);
+    memcpy(d->hdr->magic, DISK_MAGIC, 8);
+    d->hdr->nslots = DISK_INDEX_SLOTS;
+    d->hdr->log_size = DISK_LOG_SIZE;
+  }
+  return 0;
+}
+
+// a slot is valid while it is used and the log has not wrapped over it
+static int slot_valid(disk_tier *d, disk_slot *s) {
+  uint64_t end = __atomic_load_n(&d->hdr->write_pos, __ATOMIC_ACQUIRE);
+  return s->hash != 0 && end <= s->pos + DISK_LOG_SIZE;
+}
+
+// return the valid slot of hash, the caller holds the lock
+static disk_slot *slot_find(disk_tier *d, unsigned long hash) {
+  int i;
+  for (i = 0; i < DISK_PROBE; i++) {
+    disk_slot *s = &d->slots[(hash + i) & (d->hdr->nslots - 1)];
+    if (s->hash == hash && slot_valid(d, s)) return s;
+  }
+  return NULL;
+}
+
+// FNV-1a taken a word at a time over len bytes, continuing from sum
+static uint64_t checksum(uint64_t sum, const void *p, size_t len) {
+  const unsigned char *c = p;
+  uint64_t word;
+  for (; len >= 8; len -= 8, c += 8) {
+    memcpy(&word, c, 8);
+    sum = (sum ^ word) * 1099511628211UL;
+  }
+  while (len--) sum = (sum ^ *c++) * 1099511628211UL;
+  return sum;
+}
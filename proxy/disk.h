@@ -0,0 +1,47 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DISK_LOG_SIZE (256UL * 1024 * 1024)  // bytes of the object log
+#define DISK_INDEX_SLOTS 65536                // power of two
+#define DISK_PROBE 8                          // slots searched per url
+
+/* one object of the index. The record at pos is still in the log as
+ * long as the log was not written past pos + DISK_LOG_SIZE. */
+typedef struct {
+  uint64_t hash;      // hash of the url, 0 for an empty slot
+  uint64_t pos;       // where the record was appended, counting every byte
+  uint32_t len;       // bytes of the whole record
+  uint32_t size;      // bytes of the body, the last part of the record
+} disk_slot;
+
+/* start of the index file, the slots follow */
+typedef struct {
+  char magic[8];
+  uint32_t nslots;
+  uint32_t pad;
+  uint64_t log_size;
+  uint64_t write_pos;   // end of the log, counting every byte
+} disk_header;
+
+typedef struct {
+  int log_fd;
+  int index_fd;
+  disk_header *hdr;     // the index, mapped shared
+  disk_slot *slots;
+  pthread_mutex_t lock; // appends and index changes
+} disk_tier;
+
+int disk_open(disk_tier *d, const char *dir);
+void disk_put(disk_tier *d, unsigned long hash, const char *url,
+              const char *headers, const void *body, size_t size, time_t expires,
+              int replace);
+int disk_get(disk_tier *d, unsigned long hash, const char *url,
+             char **headers, void **body, size_t *size, time_t *expires);
+void disk_close(disk_tier *d);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csapp.h"
+#include "dns.h"
+
+/*
+ * In-process resolver cache in front of getaddrinfo, keyed by host:port.
+ * Entries live for DNS_TTL seconds, failed lookups for DNS_NEGATIVE_TTL.
+ * Once an entry is three quarters through its TTL, the next lookup still
+ * gets the cached addresses while a background thread resolves it again,
+ * so busy names never make a request wait on the resolver.
+ */
+
+#define DNS_BUCKETS 256
+
+typedef struct dns_entry {
+  char *host;
+  char *port;
+  dns_addr addrs[DNS_MAX_ADDRS];
+  int naddrs;                   // 0 for a failed lookup
+  time_t expires;
+  time_t refresh_at;            // start refreshing in the background after this
+  int refreshing;
+  struct dns_entry *next;
+} dns_entry;
+
+static dns_entry *buckets[DNS_BUCKETS];
+static int nentries = 0;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_name(const char *host, const char *port);
+static dns_entry *lookup_entry(const char *host, const char *port);
+static int resolve(const char *host, const char *port, dns_addr *addrs);
+static void store(const char *host, const char *port, dns_addr *addrs, int naddrs);
+static void purge_expired(time_t now);
+static void *refresh_thread(void *vargp);
+
+
+/* dns_resolve copies up to max addresses of host:port into addrs.
+ * Return the number of addresses, or -1 if the name does not resolve */
+int dns_resolve(const char *host, const char *port, dns_addr *addrs, int max) {
+  dns_addr found[DNS_MAX_ADDRS];
+  int n;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&dns_lock);
+  dns_entry *e = lookup_entry(host, port);
+  if (e && now < e->expires) {
+    n = e->naddrs;
+    memcpy(found, e->addrs, n * sizeof(dns_addr));
+
+    // refresh a busy name before it expires
+    if (n > 0 && now >= e->refresh_at && !e->refreshing) {
+      pthread_t tid;
+      e->refreshing = 1;
+      dns_entry *key = Malloc(sizeof(dns_entry));
+      key->host = strdup(host);
+      key->port = strdup(port);
+      if (pthread_create(&tid, NULL, refresh_thread, key) != 0) {
+        e->refreshing = 0;
+        free(key->host);
+        free(key->port);
+        free(key);
+      }
+    }
+    pthread_mutex_unlock(&dns_lock);
+  } else {
+    pthread_mutex_unlock(&dns_lock);
+    n = resolve(host, port, found);
+    store(host, port, found, n);
+  }
+
+  if (n == 0) return -1;
+  if (n > max) n = max;
+  memcpy(addrs, found, n * sizeof(dns_addr));
+  return n;
+}
+
+
+/* dns_connect is open_clientfd on top of the resolver cache.
+ * Return the connected descriptor, -2 if the name does not resolve,
+ * -1 if no address accepted the connection */
+int dns_connect(const char *host, const char *port) {
+  dns_addr addrs[DNS_MAX_ADDRS];
+  int n = dns_resolve(host, port, addrs, DNS_MAX_ADDRS);
+  if (n < 0) return -2;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    int fd = socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol);
+    if (fd < 0) continue;
+    if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0) return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+
+static unsigned hash_name(const char *host, const char *port) {
+  unsigned hash = 5381;
+  for (; *host; host++) hash = hash * 33 + (unsigned char)tolower(*host);
+  for (; *port; port++) hash = hash * 33 + (unsigned char)*port;
+  return hash % DNS_BUCKETS;
+}
+
+// the caller holds dns_lock
+static dns_entry *lookup_entry(const char *host, const char *port) {
+  dns_entry *e;
+  for (e = buckets[hash_name(host, port)]; e; e = e->next) {
+    if (!strcasecmp(e->host, host) && !strcmp(e->port, port)) return e;
+  }
+  return NULL;
+}
+
+// ask getaddrinfo, return the number of addresses stored in addrs
+static int resolve(const char *host, const char *port, dns_addr *addrs) {
+  struct addrinfo hints, *listp, *p;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  if (getaddrinfo(host, port, &hints, &listp) != 0) return 0;
+
+  int n = 0;
+  for (p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next) {
+    addrs[n].family = p->ai_family;
+    addrs[n].socktype = p->ai_socktype;
+    addrs[n].protocol = p->ai_protocol;
+    addrs[n].addrlen = p->ai_addrlen;
+    memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+    n++;
+  }
+  freeaddrinfo(listp);
+  return n;
+}
+
+// remember the result of a lookup, naddrs 0 caches the failure
+static void store(const char *host, const char *port, dns_addr *addrs, int naddrs) {
+  time_t now = time(NULL);
+  int ttl = naddrs? DNS_TTL:DNS_NEGATIVE_TTL;
+
+  pthread_mutex_lock(&dns_lock);
+  dns_entry *e = lookup_entry(host, port);
+  if (e == NULL) {
+    if (nentries >= DNS_MAX_ENTRIES) purge_expired(now);
+    if (nentries >= DNS_MAX_ENTRIES) {   // still full, just don't cache
+      pthread_mutex_unlock(&dns_lock);
+      return;
+    }
+    e = Calloc(1, sizeof(dns_entry));
+    e->host = strdup(host);
+    e->port = strdup(port);
+    unsigned b = hash_name(host, port);
+    e->next = buckets[b];
+    buckets[b] = e;
+    nentries++;
+  }
+
+  // a failed refresh keeps serving the addresses it had
+  if (naddrs > 0 || e->naddrs == 0 || now >= e->expires) {
+    memcpy(e->addrs, addrs, naddrs * sizeof(dns_addr));
+    e->naddrs = naddrs;
+    e->expires = now + ttl;
+    e->refresh_at = now + ttl * 3 / 4;
+  }
+  e->refreshing = 0;
+  pthread_mutex_unlock(&dns_lock);
+}
+
+// drop expired entries, the caller holds dns_lock
+static void purge_expired(time_t now) {
+  int i;
+  for (i = 0; i < DNS_BUCKETS; i++) {
+    dns_entry **pp = &buckets[i];
+    while (*pp) {
+      dns_entry *e = *pp;
+      if (now >= e->expires && !e->refreshing) {
+        *pp = e->next;
+        free(e->host);
+        free(e->port);
+        free(e);
+        nentries--;
+      } else {
+        pp = &e->next;
+      }
+    }
+  }
+}
+
+// resolve a name again in the background
+static void *refresh_thread(void *vargp) {
+  dns_entry *key = vargp;
+  dns_addr addrs[DNS_MAX_ADDRS];
+
+  Pthread_detach(pthread_self());
+  int n = resolve(key->host, key->port, addrs);
+  store(key->host, key->port, addrs, n);
+
+  free(key->host);
+  free(key->port);
+  free(key);
+  return NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <sys/socket.h>
+
+#define DNS_TTL 60            // seconds a resolved name is kept
+#define DNS_NEGATIVE_TTL 10   // seconds a failed lookup is remembered
+#define DNS_MAX_ADDRS 8       // addresses kept per name
+#define DNS_MAX_ENTRIES 1024  // names kept at most
+
+/* one address a name resolved to, enough to create and connect a socket */
+typedef struct {
+  int family;
+  int socktype;
+  int protocol;
+  socklen_t addrlen;
+  struct sockaddr_storage addr;
+} dns_addr;
+
+int dns_resolve(const char *host, const char *port, dns_addr *addrs, int max);
+int dns_connect(const char *host, const char *port);
+
+#endif /* __DNS_H__ */
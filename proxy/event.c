@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "frame.h"
+#include "fresh.h"
+#include "metrics.h"
+#include "range.h"
+#include "compress.h"
+#include "timer.h"
+
+/*
+ * Event driven engine, selected with "proxy -e". Every thread runs its
+ * own epoll loop over non-blocking sockets, and each connection walks
+ * through the same steps as doit() as a small state machine:
+ *
+ *   READ_REQ -> CONNECT -> SEND_REQ -> RELAY_HDRS -> RELAY_BODY
+ *      \-> SEND_HIT (cache hit)
+ *
+ * Both sockets of a connection are registered edge-triggered for input
+ * and output at once, so conn_advance only has to keep going until some
+ * call would block, and it is simply called again on the next event.
+ *
+ * Whenever a connection blocks, its deadline on the loop's timer wheel
+ * moves to the timeout of what it waits for (-t): the client to take
+ * what is written, or the server to send more. A request has to come in
+ * whole within the read timeout of its first byte however it trickles
+ * in. Bodies go through the one buffer of a connection, which is
+ * written out before the server is read again, so a slow client holds
+ * the server back rather than have the proxy buffer for it.
+ */
+
+#define MAX_EVENTS 256
+
+// what a blocked connection waits for
+enum { WAIT_IDLE, WAIT_READ, WAIT_WRITE };
+
+typedef enum {
+  READ_REQ,     // reading the request line and headers from the client
+  CONNECT,      // waiting for the non-blocking connect to the server
+  SEND_REQ,     // writing the rewritten request to the server
+  RELAY_HDRS,   // reading the response headers from the server
+  RELAY_BODY,   // relaying the response to the client
+  SEND_HIT,     // writing a cached response to the client
+  CLOSED        // finished, freed once the current batch of events is done
+} conn_state;
+
+typedef struct conn {
+  conn_state state;
+  int clientfd;
+  int serverfd;
+  char uri[MAXLINE];
+
+  char req[MAXLINE];      // request from the client
+  size_t req_len;
+
+  char hdrs[MAXLINE];     // response headers from the server
+  size_t hdrs_len;
+  resp_flags rf;
+  char *cached_hdrs;      // rewritten headers kept for the cache
+  int gzip;               // the client takes gzip
+
+  char buf[MAXBUF + 64];  // bytes waiting to be written to a peer, with
+                          // room for our connection header on full hdrs
+  size_t buf_len;
+  size_t buf_off;
+
+  frame_t fr;             // where the body ends, and its copy for the cache
+
+  CachedItem *item;       // cache hit being sent
+  range_resp *range;      // the ranges cut out of it, NULL for all of it
+  size_t hit_off;
+
+  long start;             // when the request came, 0 before, in microseconds
+  long mark;              // when the connect or the request send started
+  int result;             // how it is answered, a RESULT_*
+  int status;             // status code sent back, 0 if none
+  size_t sent;            // bytes written to the client
+
+  wheel_timer timer;      // deadline of what it waits for
+  int waiting;            // a WAIT_*
+
+  struct conn *next_dead;
+} conn_t;
+
+typedef struct {
+  int epfd;
+  int listenfd;
+  CacheList *cache;
+  conn_t *dead;           // closed connections, events may still name them
+  timer_wheel wheel;      // deadlines of its connections
+} loop_t;
+
+static void *event_loop(void *vargp);
+static void accept_conns(loop_t *lp);
+static void conn_advance(loop_t *lp, conn_t *c);
+static void conn_close(loop_t *lp, conn_t *c);
+static int start_request(loop_t *lp, conn_t *c, size_t hdr_end);
+static int refuse(conn_t *c, int status);
+static int start_response(conn_t *c, size_t hdr_end);
+static long find_hdr_end(const char *buf, size_t len);
+static int open_clientfd_nb(char *hostname, char *port);
+static int watch(loop_t *lp, int fd, conn_t *c);
+static void set_nonblocking(int fd);
+static void deadline(loop_t *lp, conn_t *c, int waiting);
+static void expire_conns(loop_t *lp);
+
+
+/* event_loops starts nloops event loops sharing listenfd, and
+ * runs the last one in the calling thread. */
+void event_loops(int listenfd, int nloops, CacheList *cache) {
+  pthread_t tid;
+  set_nonblocking(listenfd);
+
+  int i;
+  for (i = 0; i < nloops; i++) {
+    loop_t *lp = Malloc(sizeof(loop_t));
+    lp->listenfd = listenfd;
+    lp->cache = cache;
+    lp->dead = NULL;
+    timer_init(&lp->wheel, now_us() / 1000);
+    if ((lp->epfd = epoll_create1(0)) < 0)
+      unix_error("epoll_create1 error");
+
+    // EPOLLEXCLUSIVE wakes a single loop per incoming connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;   // NULL marks the listening socket
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+      unix_error("epoll_ctl error");
+
+    if (i == nloops - 1)
+      event_loop(lp);
+    else
+      Pthread_create(&tid, NULL, event_loop, lp);
+  }
+}
+
+
+static void *event_loop(void *vargp) {
+  loop_t *lp = vargp;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(lp->epfd, events, MAX_EVENTS, timer_wait(&lp->wheel, now_us() / 1000));
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL)
+        accept_conns(lp);
+      else
+        conn_advance(lp, events[i].data.ptr);
+    }
+    expire_conns(lp);
+
+    while (lp->dead) {
+      conn_t *c = lp->dead;
+      lp->dead = c->next_dead;
+      free(c);
+    }
+  }
+  return NULL;
+}
+
+
+// accept every pending connection and start reading its request
+static void accept_conns(loop_t *lp) {
+  while (1) {
+    int connfd = accept(lp->listenfd, NULL, NULL);
+    if (connfd < 0) return;   // EAGAIN, or another loop took it
+    set_nonblocking(connfd);
+
+    conn_t *c = Calloc(1, sizeof(conn_t));
+    c->state = READ_REQ;
+    c->clientfd = connfd;
+    c->serverfd = -1;
+    if (watch(lp, connfd, c) < 0) {
+      conn_close(lp, c);
+      continue;
+    }
+    deadline(lp, c, WAIT_IDLE);
+    conn_advance(lp, c);
+  }
+}
+
+
+/* conn_advance runs the state machine of one connection until an
+ * operation would block or the connection is finished. */
+static void conn_advance(loop_t *lp, conn_t *c) {
+  ssize_t n;
+  long end;
+
+  while (1) {
+    switch (c->state) {
+      case READ_REQ:
+        n = read(c->clientfd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len);
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) goto done;
+        c->req_len += n;
+        c->req[c->req_len] = '\0';
+        if (c->waiting == WAIT_IDLE) deadline(lp, c, WAIT_READ);   // from its first byte
+
+        if ((end = find_hdr_end(c->req, c->req_len)) < 0) {
+          if (c->req_len == sizeof(c->req) - 1) goto done;  // too long
+          break;
+        }
+        c->start = now_us();
+        if (!start_request(lp, c, end)) goto done;
+        break;
+
+      case CONNECT: {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->serverfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+          METRIC_ADD(upstream_errors, 1);
+          goto done;
+        }
+        histogram_add(&metrics->connect_us, now_us() - c->mark);
+        c->state = SEND_REQ;
+        break;
+      }
+
+      case SEND_REQ:
+        n = write(c->serverfd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+        if (n < 0 && (errno == EAGAIN || errno == ENOTCONN)) {
+          deadline(lp, c, WAIT_READ);
+          return;
+        }
+        if (n < 0) goto done;
+        c->buf_off += n;
+        if (c->buf_off == c->buf_len) {
+          c->buf_off = c->buf_len = 0;
+          c->mark = now_us();
+          c->state = RELAY_HDRS;
+        }
+        break;
+
+      case RELAY_HDRS:
+        n = read(c->serverfd, c->hdrs + c->hdrs_len, sizeof(c->hdrs) - 1 - c->hdrs_len);
+        if (n < 0 && errno == EAGAIN) {
+          deadline(lp, c, WAIT_READ);
+          return;
+        }
+        if (n <= 0) goto done;
+        if (c->hdrs_len == 0) histogram_add(&metrics->ttfb_us, now_us() - c->mark);
+        c->hdrs_len += n;
+        c->hdrs[c->hdrs_len] = '\0';
+
+        if ((end = find_hdr_end(c->hdrs, c->hdrs_len)) < 0) {
+          if (c->hdrs_len == sizeof(c->hdrs) - 1) goto done;
+          break;
+        }
+        if (!start_response(c, end)) goto done;
+        break;
+
+      case RELAY_BODY:
+        // flush what is buffered before reading more from the server
+        if (c->buf_off < c->buf_len) {
+          n = write(c->clientfd, c->buf + c->buf_off, c->buf_len - c->buf_off);
+          if (n < 0 && errno == EAGAIN) {
+            deadline(lp, c, WAIT_WRITE);
+            return;
+          }
+          if (n < 0) goto done;
+          c->buf_off += n;
+          c->sent += n;
+          break;
+        }
+        c->buf_off = c->buf_len = 0;
+
+        if (c->fr.done) {
+          // whole body relayed, do the caching
+          if (c->fr.copy) {
+            char *hdrs = frame_headers(c->cached_hdrs, c->fr.copy_len);
+            size_t len = c->fr.copy_len;
+            char key[MAXLINE + 8];
+            cache_URL(variant_key(key, c->uri, gzip_encoded(hdrs)), hdrs, c->fr.copy, len,
+                      lp->cache);
+            if (c->gzip) compress_async(c->uri, hdrs, len);
+            free(hdrs);
+            c->fr.copy = NULL;
+          }
+          goto done;
+        }
+
+        // the server closes after this response, so reading past the
+        // end of the body does no harm, frame_feed cuts it off
+        size_t want = frame_want(&c->fr);
+        if (want == 0 || want > sizeof(c->buf)) want = sizeof(c->buf);
+        n = read(c->serverfd, c->buf, want);
+        if (n < 0 && errno == EAGAIN) {
+          deadline(lp, c, WAIT_READ);
+          return;
+        }
+        if (n < 0) goto done;
+        if (n == 0) {
+          frame_eof(&c->fr);   // ends a close-delimited body
+          if (!c->fr.done) goto done;   // truncated
+          break;
+        }
+        if ((n = frame_feed(&c->fr, c->buf, n)) < 0) goto done;
+        c->buf_len = n;
+        break;
+
+      case CLOSED:
+        return;
+
+      case SEND_HIT: {
+        struct iovec iov[RANGE_MAX * 2 + 2];
+        int cnt;
+        if (c->range) {
+          cnt = c->range->cnt;
+          memcpy(iov, c->range->iov, cnt * sizeof(iov[0]));
+        } else {
+          cnt = cached_iov(c->item, 0, iov);
+        }
+
+        // skip what was already written
+        int i = 0;
+        size_t skip = c->hit_off;
+        while (i < cnt && skip >= iov[i].iov_len) skip -= iov[i++].iov_len;
+        if (i == cnt) goto done;
+        iov[i].iov_base = (char *)iov[i].iov_base + skip;
+        iov[i].iov_len -= skip;
+
+        n = writev(c->clientfd, iov + i, cnt - i);
+        if (n < 0 && errno == EAGAIN) {
+          deadline(lp, c, WAIT_WRITE);
+          return;
+        }
+        if (n < 0) goto done;
+        c->hit_off += n;
+        c->sent += n;
+        break;
+      }
+    }
+  }
+
+done:
+  conn_close(lp, c);
+}
+
+
+// release everything held by a connection, the struct itself is
+// freed by event_loop after the current batch
+static void conn_close(loop_t *lp, conn_t *c) {
+  if (c->start)
+    metrics_request(c->result, c->status, c->uri, c->sent, now_us() - c->start);
+  if (c->item) cache_release(c->item, lp->cache);
+  timer_cancel(&lp->wheel, &c->timer);
+  if (c->serverfd >= 0) close(c->serverfd);
+  close(c->clientfd);
+  free(c->fr.copy);
+  free(c->cached_hdrs);
+  free(c->range);
+  c->state = CLOSED;
+  c->next_dead = lp->dead;
+  lp->dead = c;
+}
+
+
+/* start_request handles a complete request header block: answers it
+ * from the cache, or rewrites it into buf and connects to the server.
+ * Return 1 if succeed, otherwise return 0 */
+static int start_request(loop_t *lp, conn_t *c, size_t hdr_end) {
+  char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+  http_request r;
+
+  long parsed = http_parse_request(c->req, hdr_end, &r);
+  if (parsed <= 0) return refuse(c, (parsed == HTTP_TOO_MANY)? 431:400);
+  if (!http_slice_is(r.method, "GET")) return refuse(c, 501);
+  if (r.uri.len >= sizeof(c->uri)) return refuse(c, 400);
+  memcpy(c->uri, r.uri.p, r.uri.len);
+  c->uri[r.uri.len] = '\0';
+
+  // our own /metrics goes out of buf like the start of a response whose
+  // body is all there
+  if (!strcmp(c->uri, "/metrics")) {
+    if (!local_client(c->clientfd)) return refuse(c, 403);
+    c->buf_len = metrics_response(c->buf, sizeof(c->buf), lp->cache, 0);
+    if (c->buf_len == 0) return refuse(c, 500);
+    c->fr.done = 1;
+    c->result = RESULT_METRICS;
+    c->status = 200;
+    c->state = RELAY_BODY;
+    return 1;
+  }
+  c->result = RESULT_ERROR;   // until it is answered
+
+  // check if the uri is currently cached and fresh. Stale items are
+  // fetched again in full, which replaces them. Ranges are cut out of
+  // hits only, misses fetch and send the whole object, or forward
+  // several ranges for the origin to cut. The variant looked up is the
+  // one the client takes, as in read_request, and a gzipped item goes as
+  // it is
+  char key[MAXLINE + 8];
+  c->gzip = accepts_gzip(&r);
+  c->item = find_nowait(variant_key(key, c->uri, c->gzip), lp->cache);
+  if (c->item == NULL && c->gzip && (c->item = find_nowait(c->uri, lp->cache)))
+    compress_async(c->uri, c->item->headers, c->item->size);
+  if (c->item != NULL) {
+    if (time(NULL) < c->item->expires) {
+      CachedItem *item = c->item;
+      c->result = RESULT_HIT;
+      c->state = SEND_HIT;
+      c->status = 200;
+      if (item->gzip) return 1;
+
+      byte_range ranges[RANGE_MAX];
+      int n = range_request(&r, item->headers, ranges);
+      if (n > 0) {
+        c->range = Malloc(sizeof(range_resp));
+        if (range_response(item, ranges, n, 0, c->range)) {
+          c->status = c->range->status;
+        } else {
+          free(c->range);
+          c->range = NULL;
+        }
+      }
+      return 1;
+    }
+    cache_release(c->item, lp->cache);
+    c->item = NULL;
+  }
+
+  if (!parse_url(c->uri, host, port, path)) return refuse(c, 400);
+
+  // request line, then the rewritten headers gathered behind it
+  c->buf_len = snprintf(c->buf, sizeof(c->buf), "GET %s HTTP/1.0\r\n", path);
+  struct iovec iov[REWRITE_IOV];
+  int cnt = rewrite_request(&r, host, iov);
+  int i;
+  for (i = 0; i < cnt; i++) {
+    if (c->buf_len + iov[i].iov_len + 64 >= sizeof(c->buf)) return 0;
+    memcpy(c->buf + c->buf_len, iov[i].iov_base, iov[i].iov_len);
+    c->buf_len += iov[i].iov_len;
+  }
+  byte_range ranges[RANGE_MAX];
+  if (range_request(&r, NULL, ranges) > 1) {
+    size_t n = range_forward(&r, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len - 64);
+    c->buf_len += n;
+  }
+  c->buf_len += sprintf(c->buf + c->buf_len, "%sConnection: close\r\n\r\n",
+                        c->gzip? "Accept-Encoding: gzip\r\n":"");
+
+  // Make a connection with webserver
+  c->mark = now_us();
+  if ((c->serverfd = open_clientfd_nb(host, port)) < 0) {
+    METRIC_ADD(upstream_errors, 1);
+    return 0;
+  }
+  if (watch(lp, c->serverfd, c) < 0) return 0;
+  deadline(lp, c, WAIT_READ);
+  c->state = CONNECT;
+  return 1;
+}
+
+
+// answer a request the proxy does not serve with status, out of buf
+// like /metrics. Return 1
+static int refuse(conn_t *c, int status) {
+  c->buf_len = error_response(c->buf, sizeof(c->buf), status);
+  c->fr.done = 1;
+  c->result = RESULT_BAD;
+  c->status = status;
+  c->state = RELAY_BODY;
+  return 1;
+}
+
+
+/* start_response checks a complete response header block, and queues
+ * it with the hop-by-hop headers replaced, followed by the first body
+ * bytes, for the client. Return 1 if succeed, otherwise return 0 */
+static int start_response(conn_t *c, size_t hdr_end) {
+  char *p, *next;
+  size_t len = 0;
+
+  // rewrite the header lines into buf, leaving out the empty line
+  for (p = c->hdrs; *p != '\r' && *p != '\n'; p = next) {
+    next = (char *)memchr(p, '\n', c->hdrs + hdr_end - p) + 1;
+    size_t n = resp_header(p, next - p, &c->rf);
+    memcpy(c->buf + len, p, n);
+    len += n;
+  }
+  if (len + 32 >= sizeof(c->buf)) return 0;
+
+  // the cache keeps the headers with the empty line, but without ours
+  size_t extra = c->hdrs_len - hdr_end;
+  char *rest = c->hdrs + hdr_end;
+  memcpy(c->buf + len, "\r\n", 3);
+  c->cached_hdrs = strdup(c->buf);
+  len += sprintf(c->buf + len, "Connection: close\r\n\r\n");
+
+  frame_init(&c->fr, &c->rf, resp_cacheable(&c->rf));
+  c->result = RESULT_MISS;
+  c->status = c->rf.status;
+
+  // whatever body bytes came along with the headers go out next
+  long body = frame_feed(&c->fr, rest, extra);
+  if (body < 0 || len + body > sizeof(c->buf)) return 0;
+  memcpy(c->buf + len, rest, body);
+  c->buf_len = len + body;
+  c->buf_off = 0;
+
+  c->state = RELAY_BODY;
+  return 1;
+}
+
+
+// return the offset just past the empty line ending the headers, or -1
+static long find_hdr_end(const char *buf, size_t len) {
+  size_t i;
+  for (i = 0; i + 1 < len; i++) {
+    if (buf[i] != '\n') continue;
+    if (buf[i+1] == '\n') return i + 2;
+    if (buf[i+1] == '\r' && i + 2 < len && buf[i+2] == '\n') return i + 3;
+  }
+  return -1;
+}
+
+
+/* open_clientfd_nb is open_clientfd with a non-blocking connect. Names
+ * come from the resolver cache, so only a cold name blocks the loop. */
+static int open_clientfd_nb(char *hostname, char *port) {
+  dns_addr addrs[DNS_MAX_ADDRS];
+  int n = dns_resolve(hostname, port, addrs, DNS_MAX_ADDRS);
+
+  int i;
+  for (i = 0; i < n; i++) {
+    int fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK, addrs[i].protocol);
+    if (fd < 0) continue;
+    if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 || errno == EINPROGRESS)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+
+// register fd of connection c for input and output, edge-triggered
+static int watch(loop_t *lp, int fd, conn_t *c) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+// move the deadline of c to the timeout of what it waits for, from now
+static void deadline(loop_t *lp, conn_t *c, int waiting) {
+  int secs = (waiting == WAIT_WRITE)? timeouts.write:
+             (waiting == WAIT_IDLE)? timeouts.idle:timeouts.read;
+  c->waiting = waiting;
+  timer_set(&lp->wheel, &c->timer, now_us() / 1000 + secs * 1000L);
+}
+
+// close the connections past their deadline, counting what they waited for
+static void expire_conns(loop_t *lp) {
+  wheel_timer *t = timer_expire(&lp->wheel, now_us() / 1000);
+  while (t) {
+    conn_t *c = (conn_t *)((char *)t - offsetof(conn_t, timer));
+    t = t->next;
+    if (c->waiting == WAIT_WRITE) METRIC_ADD(write_timeouts, 1);
+    else if (c->waiting == WAIT_IDLE) METRIC_ADD(idle_timeouts, 1);
+    else METRIC_ADD(read_timeouts, 1);
+    conn_close(lp, c);
+  }
+}
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "flight.h"
+
+/*
+ * Single-flight coalescing of cache misses. The first request for a url
+ * that is not cached becomes the leader of a flight and fetches it; any
+ * request for the same url arriving meanwhile follows the flight instead
+ * of going to the origin, and is streamed the leader's bytes as they
+ * arrive. Only responses the cache could keep, to requests without
+ * credentials, with a Content-Length up to FLIGHT_MAX_SIZE are shared,
+ * so that nobody gets another client's answer, and a flight's buffer is
+ * bounded and allocated once, and only if somebody follows by the time
+ * the headers come: otherwise the flight ends there, the leader relays
+ * the body without a copy and later requests start a flight of their
+ * own. For any other response the followers fetch on their own, which
+ * is safe because nothing has been sent to them yet.
+ */
+
+#define FLIGHT_BUCKETS 256
+
+enum {
+  FETCHING,    // leader waiting for the response headers
+  STREAMING,   // headers published, body bytes arriving
+  DONE,        // whole body in data
+  FAILED,      // the leader gave up after publishing the headers
+  UNSHARED     // the leader gave up before, followers fetch themselves
+};
+
+struct flight {
+  char *uri;
+  char *hdrs;             // response headers without the empty line
+  size_t hdrs_len;
+  char *data;             // body bytes so far, never reallocated
+  size_t len;
+  int state;
+  int refcnt;             // leader and followers
+  int listed;             // still in the table
+  pthread_cond_t cond;    // signaled on every change
+  struct flight *next;
+};
+
+static flight_t *table[FLIGHT_BUCKETS];
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_uri(const char *uri);
+static void put_flight(flight_t *f);
+static void unlist(flight_t *f);
+
+
+/* flight_join returns the flight for uri. If nobody is fetching uri, a
+ * new flight is created and *leader is set: the caller must fetch it and
+ * end with flight_finish. Otherwise the caller follows with flight_follow */
+flight_t *flight_join(const char *uri, int *leader) {
+  unsigned b = hash_uri(uri);
+  flight_t *f;
+
+  pthread_mutex_lock(&flight_lock);
+  for (f = table[b]; f; f = f->next) {
+    if (!strcmp(f->uri, uri)) {
+      f->refcnt++;
+      *leader = 0;
+      pthread_mutex_unlock(&flight_lock);
+      return f;
+    }
+  }
+
+  f = Calloc(1, sizeof(flight_t));
+  f->uri = strdup(uri);
+  f->state = FETCHING;
+  f->refcnt = 1;
+  f->listed = 1;
+  pthread_cond_init(&f->cond, NULL);
+  f->next = table[b];
+  table[b] = f;
+  *leader = 1;
+  pthread_mutex_unlock(&flight_lock);
+  return f;
+}
+
+
+/* flight_headers publishes the response headers. Return 1 if the
+ * response is shared, then the leader must pass every body byte to
+ * flight_append. Otherwise the followers, if any, are sent off to fetch
+ * it. */
+int flight_headers(flight_t *f, const char *hdrs, size_t len, long content_length) {
+  pthread_mutex_lock(&flight_lock);
+  int shared = f->refcnt > 1 && content_length >= 0 && content_length <= FLIGHT_MAX_SIZE;
+  if (shared) {
+    f->hdrs = Malloc(len);
+    memcpy(f->hdrs, hdrs, len);
+    f->hdrs_len = len;
+    f->data = Malloc(content_length + 1);
+    f->state = STREAMING;
+  } else {
+    f->state = UNSHARED;
+    unlist(f);
+  }
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&flight_lock);
+  return shared;
+}
+
+
+// pass body bytes on to the followers
+void flight_append(flight_t *f, const char *data, size_t n) {
+  pthread_mutex_lock(&flight_lock);
+  memcpy(f->data + f->len, data, n);
+  f->len += n;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&flight_lock);
+}
+
+
+/* flight_finish ends the leader's part. ok tells whether the whole
+ * response got through; the url stops being coalesced either way. */
+void flight_finish(flight_t *f, int ok) {
+  pthread_mutex_lock(&flight_lock);
+  if (f->state == FETCHING) f->state = UNSHARED;
+  else if (f->state == STREAMING) f->state = ok? DONE:FAILED;
+  unlist(f);
+  pthread_cond_broadcast(&f->cond);
+  put_flight(f);
+  pthread_mutex_unlock(&flight_lock);
+}
+
+
+/* flight_follow streams the leader's response to fd, with the connection
+ * header for this client, adding the bytes written to *bytes. With fd -1
+ * it only waits for the response to end. Return 1 if the whole response
+ * was sent, 0 if it broke off midway, and -1 if nothing was sent because
+ * the response is not shared; the caller then fetches it itself. */
+int flight_follow(flight_t *f, int fd, int keep_alive, size_t *bytes) {
+  size_t sent = 0;
+  int rc = -1;
+
+  pthread_mutex_lock(&flight_lock);
+  while (f->state == FETCHING) pthread_cond_wait(&f->cond, &flight_lock);
+  if (f->state == UNSHARED) goto out;
+
+  // headers, then the body as it arrives
+  const char *conn = keep_alive? keepalive_hdr:close_hdr;
+  pthread_mutex_unlock(&flight_lock);
+  struct iovec iov[2] = {
+    { f->hdrs, f->hdrs_len },
+    { (char *)conn, strlen(conn) }
+  };
+  int ok = (fd < 0 || writev_all(fd, iov, 2, 0) == 0);
+  if (ok && fd >= 0) *bytes += f->hdrs_len + strlen(conn);
+  pthread_mutex_lock(&flight_lock);
+  rc = 0;
+
+  while (ok) {
+    while (f->len == sent && f->state == STREAMING)
+      pthread_cond_wait(&f->cond, &flight_lock);
+    size_t len = f->len;
+    int state = f->state;
+    if (len == sent) {
+      if (state == DONE) rc = 1;
+      break;
+    }
+
+    pthread_mutex_unlock(&flight_lock);
+    ok = (fd < 0 || write_all(fd, f->data + sent, len - sent) == 0);
+    if (ok && fd >= 0) *bytes += len - sent;
+    sent = len;
+    pthread_mutex_lock(&flight_lock);
+  }
+
+out:
+  put_flight(f);
+  pthread_mutex_unlock(&flight_lock);
+  return rc;
+}
+
+
+static unsigned hash_uri(const char *uri) {
+  unsigned hash = 5381;
+  for (; *uri; uri++) hash = hash * 33 + (unsigned char)*uri;
+  return hash % FLIGHT_BUCKETS;
+}
+
+// drop a reference, the caller holds flight_lock
+static void put_flight(flight_t *f) {
+  if (--f->refcnt > 0) return;
+  pthread_cond_destroy(&f->cond);
+  free(f->uri);
+  free(f->hdrs);
+  free(f->data);
+  free(f);
+}
+
+// take the flight out of the table, later requests start a new one.
+// The caller holds flight_lock
+static void unlist(flight_t *f) {
+  if (!f->listed) return;
+  flight_t **pp = &table[hash_uri(f->uri)];
+  while (*pp != f) pp = &(*pp)->next;
+  *pp = f->next;
+  f->listed = 0;
+}
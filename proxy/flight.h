@@ -0,0 +1,17 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stddef.h>
+#include "cache.h"
+
+#define FLIGHT_MAX_SIZE MAX_OBJECT_SIZE   // largest body shared by a flight
+
+typedef struct flight flight_t;
+
+flight_t *flight_join(const char *uri, int *leader);
+int flight_headers(flight_t *f, const char *hdrs, size_t len, long content_length);
+void flight_append(flight_t *f, const char *data, size_t n);
+void flight_finish(flight_t *f, int ok);
+int flight_follow(flight_t *f, int fd, int keep_alive, size_t *bytes);
+
+#endif /* __FLIGHT_H__ */
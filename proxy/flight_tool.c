@@ -0,0 +1,164 @@
+/*
+ * flight_tool - check that misses for the same url coming in at once
+ * share one fetch only when the answer is the same for every client.
+ *
+ *   usage: flight_tool <proxy port>
+ *
+ * Serves the urls itself, from an origin on a free local port that
+ * answers after ORIGIN_DELAY ms, so that the two clients of each case
+ * overlap, with a body naming the fetch it answers. A public response
+ * has to reach both from one fetch; a private one, one setting a cookie,
+ * and requests carrying a cookie have to be fetched for each client.
+ * Exits 1 if a case fails. Build it with csapp.c; it is not part of the
+ * proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "csapp.h"
+
+#define ORIGIN_DELAY 300   // ms before the origin answers
+#define CLIENTS 2          // asking for the url of a case at once
+
+typedef struct {
+  const char *name;
+  const char *path;        // the origin answers by its first part
+  int cookie;              // the clients send cookies of their own
+  int shared;              // one fetch is expected for both clients
+} flight_case;
+
+static const flight_case cases[] = {
+  { "public",      "/public",  0, 1 },
+  { "private",     "/private", 0, 0 },
+  { "set-cookie",  "/login",   0, 0 },
+  { "cookie sent", "/public",  1, 0 },
+};
+
+typedef struct {
+  const flight_case *c;
+  char url[MAXLINE];
+  int no;
+  char body[MAXLINE];      // what the client got, "" if it failed
+} client_arg;
+
+static char origin_port[16];
+static char *proxy_port;
+static int fetches;        // answers the origin sent, atomic
+
+static void *origin(void *vargp);
+static void *origin_conn(void *vargp);
+static void *client(void *vargp);
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <proxy port>\n", argv[0]);
+    exit(1);
+  }
+  proxy_port = argv[1];
+
+  // the origin on a port the kernel picks
+  int listenfd = open_listenfd("0");
+  if (listenfd < 0) unix_error("origin listen error");
+  struct sockaddr_in sa;
+  socklen_t salen = sizeof(sa);
+  getsockname(listenfd, (struct sockaddr *)&sa, &salen);
+  snprintf(origin_port, sizeof(origin_port), "%d", ntohs(sa.sin_port));
+  pthread_t tid;
+  Pthread_create(&tid, NULL, origin, (void *)(long)listenfd);
+
+  int failed = 0;
+  size_t k;
+  for (k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    const flight_case *c = &cases[k];
+    client_arg args[CLIENTS];
+    pthread_t tids[CLIENTS];
+    int i;
+
+    // urls of their own in every run and case, which no cache holds yet
+    __atomic_store_n(&fetches, 0, __ATOMIC_RELAXED);
+    for (i = 0; i < CLIENTS; i++) {
+      args[i].c = c;
+      args[i].no = i;
+      snprintf(args[i].url, MAXLINE, "http://127.0.0.1:%s%s/%d.%zu",
+               origin_port, c->path, (int)getpid(), k);
+      Pthread_create(&tids[i], NULL, client, &args[i]);
+    }
+    for (i = 0; i < CLIENTS; i++) pthread_join(tids[i], NULL);
+
+    int n = __atomic_load_n(&fetches, __ATOMIC_RELAXED);
+    int same = !strcmp(args[0].body, args[1].body);
+    int ok = args[0].body[0] && args[1].body[0] &&
+             (c->shared? (n == 1 && same):(n == CLIENTS && !same));
+    printf("%s %s: %d fetches, %s bodies\n", ok? "ok":"FAIL", c->name, n,
+           same? "the same":"different");
+    failed |= !ok;
+  }
+  return failed;
+}
+
+// the origin: a thread per connection
+static void *origin(void *vargp) {
+  int listenfd = (long)vargp;
+  pthread_t tid;
+
+  while (1) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd < 0) continue;
+    Pthread_create(&tid, NULL, origin_conn, (void *)(long)fd);
+  }
+  return NULL;
+}
+
+// answer one request with the number of the fetch, public, private or
+// setting a cookie by the first part of its path
+static void *origin_conn(void *vargp) {
+  int fd = (long)vargp;
+  char line[MAXLINE], path[MAXLINE], body[64], hdr[MAXLINE];
+  rio_t rio;
+
+  Pthread_detach(pthread_self());
+  rio_readinitb(&rio, fd);
+  if (rio_readlineb(&rio, line, MAXLINE) > 0 && sscanf(line, "%*s %s", path) == 1) {
+    ssize_t n;
+    while ((n = rio_readlineb(&rio, line, MAXLINE)) > 2)
+      ;
+    if (n > 0) {
+      usleep(ORIGIN_DELAY * 1000);
+      int no = __atomic_add_fetch(&fetches, 1, __ATOMIC_RELAXED);
+      int blen = snprintf(body, sizeof(body), "fetch %d of %s\n", no, path);
+      char extra[64] = "";
+      if (!strncmp(path, "/private/", 9))
+        strcpy(extra, "Cache-Control: private\r\n");
+      else if (!strncmp(path, "/login/", 7))
+        snprintf(extra, sizeof(extra), "Set-Cookie: session=%d\r\n", no);
+      int len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                         "%sConnection: close\r\n\r\n%s", blen, extra, body);
+      rio_writen(fd, hdr, len);
+    }
+  }
+  Close(fd);
+  return NULL;
+}
+
+// ask the proxy for the url of a case, and keep the body of the answer
+static void *client(void *vargp) {
+  client_arg *a = vargp;
+  char req[MAXLINE * 2], cookie[64] = "", resp[MAXLINE];
+
+  a->body[0] = '\0';
+  if (a->c->cookie) snprintf(cookie, sizeof(cookie), "Cookie: id=%d\r\n", a->no);
+  int fd = open_clientfd("127.0.0.1", proxy_port);
+  if (fd < 0) return NULL;
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n%s\r\n", a->url, cookie);
+  rio_t rio;
+  rio_readinitb(&rio, fd);
+  ssize_t n;
+  if (rio_writen(fd, req, len) == len &&
+      (n = rio_readnb(&rio, resp, sizeof(resp) - 1)) > 0) {
+    resp[n] = '\0';
+    char *body = strstr(resp, "\r\n\r\n");
+    if (!strncmp(resp + 8, " 200", 4) && body) snprintf(a->body, MAXLINE, "%s", body + 4);
+  }
+  Close(fd);
+  return NULL;
+}
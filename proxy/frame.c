@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "csapp.h"
+#include "frame.h"
+#include "http.h"
+
+/*
+ * Response framing. The body bytes are relayed to the client as they
+ * came, while a frame_t follows them to tell where the body ends and
+ * keeps a decoded copy for the cache: chunked bodies lose their chunk
+ * sizes and trailers, and bodies ended by the server closing are kept
+ * like any other. The copy is dropped once it grows past
+ * MAX_OBJECT_SIZE. Since the cached copy is no longer chunked, it is
+ * stored with headers that give its length instead.
+ */
+
+// states of the chunked decoder
+#define CHUNK_SIZE 0        // hex digits of the chunk size
+#define CHUNK_EXT 1         // rest of the size line
+#define CHUNK_DATA 2
+#define CHUNK_DATA_END 3    // CRLF after the data
+#define CHUNK_TRAILER 4     // start of a trailer line, or the empty line
+#define CHUNK_TRAILER_LINE 5
+
+#define COPY_INIT 8192      // first allocation for a body of unknown size
+
+static void keep(frame_t *f, const char *data, size_t n);
+static int size_line_end(frame_t *f);
+
+
+/* frame_init starts following the body of a response with the given
+ * header flags, to the close if its length is not one. With keep set, a decoded copy of the body is kept as
+ * long as it fits in MAX_OBJECT_SIZE. */
+void frame_init(frame_t *f, const resp_flags *rf, int keep) {
+  memset(f, 0, sizeof(*f));
+  if (!resp_has_body(rf->status)) {
+    f->type = FRAME_NONE;
+  } else if (rf->chunked) {
+    f->type = FRAME_CHUNKED;
+    f->state = CHUNK_SIZE;
+  } else if (rf->fl2 && rf->content_length >= 0) {
+    f->type = FRAME_LENGTH;
+    f->remaining = rf->content_length;
+  } else {
+    f->type = FRAME_CLOSE;
+  }
+  f->done = f->type == FRAME_NONE || (f->type == FRAME_LENGTH && f->remaining == 0);
+
+  if (!keep || (f->type == FRAME_LENGTH && f->remaining > MAX_OBJECT_SIZE)) return;
+  f->copy_cap = (f->type == FRAME_LENGTH)? f->remaining:COPY_INIT;
+  f->copy = Malloc(f->copy_cap + 1);
+}
+
+
+/* frame_want returns how many bytes may be read without going past the
+ * end of the body, 0 meaning a line: a chunk size, the CRLF after a
+ * chunk, or a trailer. Bodies ended by a close take any amount. */
+size_t frame_want(frame_t *f) {
+  if (f->done) return 0;
+  switch (f->type) {
+    case FRAME_LENGTH:
+      return f->remaining;
+    case FRAME_CHUNKED:
+      return (f->state == CHUNK_DATA)? f->remaining:0;
+    default:
+      return MAXBUF;
+  }
+}
+
+
+/* frame_feed follows n more bytes of the response. Return how many of
+ * them belong to the body, whatever follows its end is not part of it,
+ * or -1 if the chunk framing is broken. */
+long frame_feed(frame_t *f, const char *data, size_t n) {
+  if (f->done) return 0;
+  if (f->type == FRAME_LENGTH) {
+    if ((long)n > f->remaining) n = f->remaining;
+    keep(f, data, n);
+    f->remaining -= n;
+    f->done = (f->remaining == 0);
+    return n;
+  }
+  if (f->type != FRAME_CHUNKED) {
+    keep(f, data, n);
+    return n;
+  }
+
+  size_t i = 0;
+  while (i < n && !f->done) {
+    char c = data[i];
+    switch (f->state) {
+      case CHUNK_SIZE:
+        if (isxdigit((unsigned char)c)) {
+          if (++f->digits > 15) return -1;
+          f->remaining = f->remaining * 16 +
+                         (isdigit((unsigned char)c)? c - '0':tolower(c) - 'a' + 10);
+        } else if (c == '\n') {
+          if (size_line_end(f) < 0) return -1;
+        } else {
+          f->state = CHUNK_EXT;   // extensions, or the CR
+        }
+        i++;
+        break;
+
+      case CHUNK_EXT:
+        if (c == '\n' && size_line_end(f) < 0) return -1;
+        i++;
+        break;
+
+      case CHUNK_DATA: {
+        size_t take = n - i;
+        if ((long)take > f->remaining) take = f->remaining;
+        keep(f, data + i, take);
+        f->remaining -= take;
+        if (f->remaining == 0) f->state = CHUNK_DATA_END;
+        i += take;
+        break;
+      }
+
+      case CHUNK_DATA_END:
+        if (c == '\n') {
+          f->state = CHUNK_SIZE;
+          f->remaining = f->digits = 0;
+        } else if (c != '\r') {
+          return -1;
+        }
+        i++;
+        break;
+
+      case CHUNK_TRAILER:
+        if (c == '\n') f->done = 1;
+        else if (c != '\r') f->state = CHUNK_TRAILER_LINE;
+        i++;
+        break;
+
+      case CHUNK_TRAILER_LINE:
+        if (c == '\n') f->state = CHUNK_TRAILER;
+        i++;
+        break;
+    }
+  }
+  return i;
+}
+
+
+/* frame_eof tells the frame the server closed the connection, which
+ * ends the body only if nothing else would have. */
+void frame_eof(frame_t *f) {
+  if (f->type == FRAME_CLOSE) f->done = 1;
+}
+
+
+/* frame_headers returns a copy of the response headers hdrs, ending with
+ * the empty line, to store with a decoded body of body_len bytes: the
+ * framing headers are replaced by a content-length. */
+char *frame_headers(const char *hdrs, size_t body_len) {
+  size_t left = strlen(hdrs);
+  char *out = Malloc(left + 64);
+  char *p = out;
+  http_header h;
+
+  while (*hdrs && *hdrs != '\r' && *hdrs != '\n') {
+    size_t n = http_parse_header(hdrs, left, &h);
+    if (n == 0) {   // a last line without its line end
+      n = left;
+      h.id = HDR_OTHER;
+    }
+    if (h.id != HDR_CONTENT_LENGTH && h.id != HDR_TRANSFER_ENCODING) {
+      memcpy(p, hdrs, n);
+      p += n;
+    }
+    hdrs += n;
+    left -= n;
+  }
+  sprintf(p, "Content-Length: %zu\r\n\r\n", body_len);
+  return out;
+}
+
+
+// add decoded body bytes to the copy, dropping it once it is too big
+static void keep(frame_t *f, const char *data, size_t n) {
+  if (f->copy == NULL) return;
+  if (f->copy_len + n > MAX_OBJECT_SIZE) {
+    free(f->copy);
+    f->copy = NULL;
+    return;
+  }
+  if (f->copy_len + n > f->copy_cap) {
+    if (f->copy_cap == 0) f->copy_cap = COPY_INIT;
+    while (f->copy_len + n > f->copy_cap) f->copy_cap *= 2;
+    if (f->copy_cap > MAX_OBJECT_SIZE) f->copy_cap = MAX_OBJECT_SIZE;
+    if ((f->copy = realloc(f->copy, f->copy_cap + 1)) == NULL)
+      unix_error("realloc error");
+  }
+  memcpy(f->copy + f->copy_len, data, n);
+  f->copy_len += n;
+}
+
+// a chunk size line ended, go on with its data, or the trailer after
+// the last chunk. Return -1 if the line had no size
+static int size_line_end(frame_t *f) {
+  if (f->digits == 0) return -1;
+  f->state = (f->remaining == 0)? CHUNK_TRAILER:CHUNK_DATA;
+  return 0;
+}
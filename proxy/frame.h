@@ -0,0 +1,30 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "proxy.h"
+
+/* how the end of a response body is found */
+#define FRAME_NONE 0      // no body
+#define FRAME_LENGTH 1    // content-length bytes
+#define FRAME_CHUNKED 2   // chunked transfer encoding
+#define FRAME_CLOSE 3     // until the server closes
+
+/* a response body on its way through the proxy */
+typedef struct {
+  int type;
+  int state;          // where the chunked decoder is
+  long remaining;     // bytes left in the body, or in the current chunk
+  int digits;         // hex digits of the chunk size read so far
+  int done;           // the whole body went through
+  char *copy;         // decoded body kept for the cache, NULL if not kept
+  size_t copy_len;
+  size_t copy_cap;
+} frame_t;
+
+void frame_init(frame_t *f, const resp_flags *rf, int keep);
+size_t frame_want(frame_t *f);
+long frame_feed(frame_t *f, const char *data, size_t n);
+void frame_eof(frame_t *f);
+char *frame_headers(const char *hdrs, size_t body_len);
+
+#endif /* __FRAME_H__ */
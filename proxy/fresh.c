@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "fresh.h"
+
+/*
+ * HTTP freshness of cached responses (RFC 9111, simplified). A response
+ * is fresh for s-maxage or max-age seconds, else until Expires, counted
+ * from its Date less its Age. Without any of these, a response with a
+ * Last-Modified date is fresh for a tenth of its age then, as browsers
+ * do, and any other for FRESH_DEFAULT seconds. no-cache means it has to
+ * be revalidated every time.
+ */
+
+static long directive(const char *cc, const char *name);
+static time_t parse_date(const char *s);
+
+
+/* fresh_until returns when the response with headers hdrs, received at
+ * now, stops being fresh. */
+time_t fresh_until(const char *hdrs, time_t now) {
+  char val[256];
+  time_t base = now;
+
+  // the origin's clock counts from when it sent the response, ours can't
+  // be behind it
+  if (header_value(hdrs, "date", val, sizeof(val))) {
+    time_t date = parse_date(val);
+    if (date > 0 && date < now) base = date;
+  }
+  if (header_value(hdrs, "age", val, sizeof(val))) base -= atol(val);
+  return base + fresh_lifetime(hdrs, 1);
+}
+
+/* fresh_lifetime returns for how many seconds the response with headers
+ * hdrs is fresh. Without explicit freshness, return the heuristic one if
+ * heuristic is set, otherwise -1. */
+long fresh_lifetime(const char *hdrs, int heuristic) {
+  char cc[256], val[256];
+  long n;
+
+  if (header_value(hdrs, "cache-control", cc, sizeof(cc))) {
+    if (directive(cc, "no-cache") >= 0) return 0;
+    if ((n = directive(cc, "s-maxage")) >= 0) return n;
+    if ((n = directive(cc, "max-age")) >= 0) return n;
+  }
+  if (header_value(hdrs, "expires", val, sizeof(val))) {
+    time_t expires = parse_date(val);
+    time_t date = header_value(hdrs, "date", val, sizeof(val))? parse_date(val):0;
+    if (date <= 0) date = time(NULL);
+    return (expires > date)? expires - date:0;   // invalid means expired
+  }
+  if (!heuristic) return -1;
+
+  if (header_value(hdrs, "last-modified", val, sizeof(val))) {
+    time_t modified = parse_date(val);
+    time_t date = header_value(hdrs, "date", val, sizeof(val))? parse_date(val):time(NULL);
+    if (modified > 0 && date > modified) {
+      n = (date - modified) / 10;
+      return (n > FRESH_HEURISTIC_MAX)? FRESH_HEURISTIC_MAX:n;
+    }
+  }
+  return FRESH_DEFAULT;
+}
+
+/* fresh_swr returns for how many seconds after it expires the response
+ * may still be served while it is revalidated, 0 if it must not, or -1
+ * if the origin does not say. */
+int fresh_swr(const char *hdrs) {
+  char cc[256];
+  long n;
+
+  if (!header_value(hdrs, "cache-control", cc, sizeof(cc))) return -1;
+  if (directive(cc, "must-revalidate") >= 0 || directive(cc, "proxy-revalidate") >= 0 ||
+      directive(cc, "no-cache") >= 0)
+    return 0;
+  if ((n = directive(cc, "stale-while-revalidate")) >= 0) return n;
+  return -1;
+}
+
+/* header_value copies the value of the first header called name in hdrs
+ * into buf, without the surrounding spaces. Return 1 if found, 0 if not */
+int header_value(const char *hdrs, const char *name, char *buf, size_t len) {
+  size_t name_len = strlen(name);
+  const char *line = hdrs;
+
+  while (*line && *line != '\r' && *line != '\n') {
+    const char *next = strchr(line, '\n');
+    next = next? next + 1:line + strlen(line);
+    if (!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+      const char *v = line + name_len + 1;
+      const char *end = next;
+      while (*v == ' ' || *v == '\t') v++;
+      while (end > v && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ')) end--;
+      if ((size_t)(end - v) >= len) end = v + len - 1;
+      memcpy(buf, v, end - v);
+      buf[end - v] = '\0';
+      return 1;
+    }
+    line = next;
+  }
+  return 0;
+}
+
+
+/* gzip_encoded returns 1 if a response with headers has a gzip-encoded
+ * body, and no other coding on top of it */
+int gzip_encoded(const char *headers) {
+  char val[64];
+  return header_value(headers, "content-encoding", val, sizeof(val)) &&
+         (!strcasecmp(val, "gzip") || !strcasecmp(val, "x-gzip"));
+}
+
+
+// return the value of the cache-control directive name, 0 if it has
+// none, or -1 if the directive is not there
+static long directive(const char *cc, const char *name) {
+  size_t len = strlen(name);
+  const char *p = cc;
+
+  while (*p) {
+    while (*p == ' ' || *p == ',') p++;
+    if (!strncasecmp(p, name, len) && (p[len] == '\0' || p[len] == ',' ||
+                                       p[len] == ' ' || p[len] == '=')) {
+      if (p[len] != '=') return 0;
+      return atol(p + len + 1 + (p[len + 1] == '"'));
+    }
+    while (*p && *p != ',') p++;
+  }
+  return -1;
+}
+
+// parse an HTTP date like "Sun, 06 Nov 1994 08:49:37 GMT", 0 if invalid
+static time_t parse_date(const char *s) {
+  static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char mon[4];
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(s, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon, &tm.tm_year,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    return 0;
+  const char *m = strstr(months, mon);
+  if (m == NULL || (m - months) % 3) return 0;
+  tm.tm_mon = (m - months) / 3;
+  tm.tm_year -= 1900;
+  return timegm(&tm);
+}
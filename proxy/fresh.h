@@ -0,0 +1,16 @@
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include <time.h>
+#include <stddef.h>
+
+#define FRESH_DEFAULT 60          // seconds for responses without freshness info
+#define FRESH_HEURISTIC_MAX 86400 // cap of the Last-Modified heuristic
+
+time_t fresh_until(const char *hdrs, time_t now);
+long fresh_lifetime(const char *hdrs, int heuristic);
+int fresh_swr(const char *hdrs);
+int header_value(const char *hdrs, const char *name, char *buf, size_t len);
+int gzip_encoded(const char *headers);
+
+#endif /* __FRESH_H__ */
@@ -0,0 +1,137 @@
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+/*
+ * HTTP/1.x header parsing without copies. A header block is scanned once,
+ * a line at a time with memchr, which glibc runs with SIMD, and whatever
+ * the proxy needs is handed back as slices of the buffer the block was
+ * read into. The few header names the proxy acts on are told apart with
+ * a perfect hash instead of comparing each name against each of them.
+ */
+
+// slot of a header name in hdr_table, from its length and its first and
+// last letters. Each name of the table gets a slot of its own, adding a
+// name may take other factors.
+#define HDR_HASH(first, last, len) \
+  ((((first) | 0x20) + 12 * ((last) | 0x20) + (len)) & 63)
+
+static const struct {
+  const char *name;
+  size_t len;
+  int id;
+} hdr_table[64] = {
+  [0]  = { "cache-control", 13, HDR_CACHE_CONTROL },
+  [4]  = { "accept-encoding", 15, HDR_ACCEPT_ENCODING },
+  [7]  = { "content-encoding", 16, HDR_CONTENT_ENCODING },
+  [17] = { "content-length", 14, HDR_CONTENT_LENGTH },
+  [21] = { "connection", 10, HDR_CONNECTION },
+  [22] = { "if-none-match", 13, HDR_IF_NONE_MATCH },
+  [25] = { "transfer-encoding", 17, HDR_TRANSFER_ENCODING },
+  [28] = { "host", 4, HDR_HOST },
+  [38] = { "vary", 4, HDR_VARY },
+  [40] = { "proxy-connection", 16, HDR_PROXY_CONNECTION },
+  [43] = { "content-type", 12, HDR_CONTENT_TYPE },
+  [45] = { "if-range", 8, HDR_IF_RANGE },
+  [47] = { "user-agent", 10, HDR_USER_AGENT },
+  [49] = { "keep-alive", 10, HDR_KEEP_ALIVE },
+  [51] = { "range", 5, HDR_RANGE },
+  [54] = { "if-modified-since", 17, HDR_IF_MODIFIED_SINCE },
+  [61] = { "etag", 4, HDR_ETAG },
+};
+
+
+/* http_parse_request parses the request line and header lines at the
+ * start of buf, up to the empty line ending them. Return the length of
+ * the whole block, 0 if it is not complete within len bytes, -1 if it
+ * is not a request, or HTTP_TOO_MANY if it has more than
+ * HTTP_MAX_HEADERS header lines. */
+long http_parse_request(const char *buf, size_t len, http_request *r) {
+  const char *end = buf + len;
+  const char *eol = memchr(buf, '\n', len);
+  if (eol == NULL) return 0;
+
+  // method SP uri SP version
+  const char *line_end = (eol > buf && eol[-1] == '\r')? eol - 1:eol;
+  const char *sp = memchr(buf, ' ', line_end - buf);
+  if (sp == NULL || sp == buf) return -1;
+  r->method = (http_slice){ buf, sp - buf };
+  const char *uri = sp + 1;
+  if ((sp = memchr(uri, ' ', line_end - uri)) == NULL || sp == uri) return -1;
+  r->uri = (http_slice){ uri, sp - uri };
+  r->version = (http_slice){ sp + 1, line_end - sp - 1 };
+  if (r->version.len == 0) return -1;
+
+  const char *p = eol + 1;
+  r->nheaders = 0;
+  while (p < end) {
+    if (*p == '\n') return p + 1 - buf;
+    if (*p == '\r' && p + 1 < end) return (p[1] == '\n')? p + 2 - buf:-1;
+    if (r->nheaders == HTTP_MAX_HEADERS) return HTTP_TOO_MANY;
+
+    size_t n = http_parse_header(p, end - p, &r->headers[r->nheaders]);
+    if (n == 0) return 0;
+    r->nheaders++;
+    p += n;
+  }
+  return 0;
+}
+
+
+/* http_parse_header parses the header line at the start of line. A line
+ * without a colon gets an empty name. Return the length of the line, 0
+ * if it does not end within len bytes. */
+size_t http_parse_header(const char *line, size_t len, http_header *h) {
+  const char *eol = memchr(line, '\n', len);
+  if (eol == NULL) return 0;
+  h->line = (http_slice){ line, eol + 1 - line };
+
+  const char *colon = memchr(line, ':', eol - line);
+  if (colon == NULL) {
+    h->id = HDR_OTHER;
+    h->name = (http_slice){ line, 0 };
+    h->value = (http_slice){ eol, 0 };
+    return h->line.len;
+  }
+
+  const char *v = colon + 1, *v_end = eol;
+  while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+  while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+  h->name = (http_slice){ line, colon - line };
+  h->value = (http_slice){ v, v_end - v };
+  h->id = http_header_id(line, colon - line);
+  return h->line.len;
+}
+
+
+/* http_header_id returns the HDR_* of a header name, HDR_OTHER for the
+ * names the proxy passes along untouched. */
+int http_header_id(const char *name, size_t len) {
+  if (len == 0) return HDR_OTHER;
+  int slot = HDR_HASH((unsigned char)name[0], (unsigned char)name[len - 1], len);
+  if (hdr_table[slot].len == len && !strncasecmp(name, hdr_table[slot].name, len))
+    return hdr_table[slot].id;
+  return HDR_OTHER;
+}
+
+
+/* http_has_token returns 1 if the comma separated list has an element
+ * called token, ignoring case and the parameters after it. */
+int http_has_token(http_slice list, const char *token) {
+  size_t len = strlen(token);
+  const char *p = list.p, *end = list.p + list.len;
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    const char *start = p;
+    while (p < end && *p != ',' && *p != ';' && *p != '=' && *p != ' ' && *p != '\t') p++;
+    if ((size_t)(p - start) == len && !strncasecmp(start, token, len)) return 1;
+    while (p < end && *p != ',') p++;
+  }
+  return 0;
+}
+
+/* http_slice_is returns 1 if s is str, ignoring case */
+int http_slice_is(http_slice s, const char *str) {
+  return strlen(str) == s.len && !strncasecmp(s.p, str, s.len);
+}
@@ -0,0 +1,60 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 64   // header lines a request may have
+#define HTTP_TOO_MANY -2      // http_parse_request: more header lines than that
+
+/* a piece of a buffer, not NUL terminated */
+typedef struct {
+  const char *p;
+  size_t len;
+} http_slice;
+
+/* the header names the proxy acts on, anything else is HDR_OTHER */
+enum {
+  HDR_OTHER,
+  HDR_HOST,
+  HDR_USER_AGENT,
+  HDR_CONNECTION,
+  HDR_PROXY_CONNECTION,
+  HDR_KEEP_ALIVE,
+  HDR_IF_MODIFIED_SINCE,
+  HDR_IF_NONE_MATCH,
+  HDR_CONTENT_LENGTH,
+  HDR_TRANSFER_ENCODING,
+  HDR_CACHE_CONTROL,
+  HDR_RANGE,
+  HDR_IF_RANGE,
+  HDR_ACCEPT_ENCODING,
+  HDR_CONTENT_ENCODING,
+  HDR_CONTENT_TYPE,
+  HDR_ETAG,
+  HDR_VARY
+};
+
+/* one header line, pointing into the buffer it was parsed from */
+typedef struct {
+  int id;             // HDR_* of its name
+  http_slice line;    // the whole line, with its line end
+  http_slice name;
+  http_slice value;   // without the spaces around it
+} http_header;
+
+/* a request line and its header lines */
+typedef struct {
+  http_slice method;
+  http_slice uri;
+  http_slice version;
+  int nheaders;
+  http_header headers[HTTP_MAX_HEADERS];
+} http_request;
+
+long http_parse_request(const char *buf, size_t len, http_request *r);
+size_t http_parse_header(const char *line, size_t len, http_header *h);
+int http_header_id(const char *name, size_t len);
+int http_has_token(http_slice list, const char *token);
+int http_slice_is(http_slice s, const char *str);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,96 @@
+/*
+ * latency_tool - measure the latency of requests through the proxy.
+ *
+ *   usage: latency_tool <proxy host> <proxy port> <url> [requests] [-c]
+ *
+ * Sends the requests one after another over a single keep-alive
+ * connection, or over a new connection each with -c, and prints the
+ * p50, p90, p99 and worst latency. Warm the cache with one request
+ * first to measure the hit path. Build it with csapp.c; it is not part
+ * of the proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csapp.h"
+
+#define DEFAULT_REQUESTS 10000
+
+static int fetch(rio_t *rio, int fd, const char *request, size_t len);
+static int cmp_double(const void *a, const void *b);
+
+int main(int argc, char **argv) {
+  int per_conn = 0;   // a new connection per request
+  if (argc > 1 && !strcmp(argv[argc - 1], "-c")) {
+    per_conn = 1;
+    argc--;
+  }
+  if (argc != 4 && argc != 5) {
+    fprintf(stderr, "usage: %s <proxy host> <proxy port> <url> [requests] [-c]\n", argv[0]);
+    exit(1);
+  }
+  int n = (argc == 5)? atoi(argv[4]):DEFAULT_REQUESTS;
+
+  char request[MAXLINE];
+  size_t len = snprintf(request, MAXLINE, "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                        argv[3], argv[1], per_conn? "Connection: close\r\n":"");
+
+  double *lat = Malloc(n * sizeof(double));
+  rio_t rio;
+  int fd = -1;
+  int i;
+  for (i = 0; i < n; i++) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (fd < 0) {
+      if ((fd = open_clientfd(argv[1], argv[2])) < 0) {
+        fprintf(stderr, "can't connect to %s:%s\n", argv[1], argv[2]);
+        exit(1);
+      }
+      rio_readinitb(&rio, fd);
+    }
+    if (fetch(&rio, fd, request, len) < 0) {
+      fprintf(stderr, "request %d failed\n", i);
+      exit(1);
+    }
+    if (per_conn) {
+      Close(fd);
+      fd = -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    lat[i] = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+  }
+
+  qsort(lat, n, sizeof(double), cmp_double);
+  printf("%d requests: p50 %.1f us  p90 %.1f us  p99 %.1f us  max %.1f us\n", n,
+         lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], lat[n - 1]);
+  return 0;
+}
+
+// send one request and read the whole response, which must carry a
+// content-length. Return 0 if succeed, otherwise return -1
+static int fetch(rio_t *rio, int fd, const char *request, size_t len) {
+  char line[MAXLINE], body[MAXBUF];
+  long length = -1;
+  ssize_t n;
+
+  if (rio_writen(fd, (void *)request, len) < 0) return -1;
+  do {
+    if ((n = rio_readlineb(rio, line, MAXLINE)) <= 0) return -1;
+    if (!strncasecmp(line, "content-length:", 15)) length = atol(line + 15);
+  } while (n > 2);
+  if (length < 0) return -1;
+
+  while (length > 0) {
+    size_t want = (length < (long)sizeof(body))? length:sizeof(body);
+    if ((n = rio_readnb(rio, body, want)) <= 0) return -1;
+    length -= n;
+  }
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,189 @@
+/*
+ * lookup_tool - time find and cache_release on caches of 10, 1k and
+ * 100k entries, for urls that are cached and for urls that are not,
+ * then on the 1k one from 1 up to -t threads at once, with -w percent
+ * of the lookups replacing the object they found.
+ *
+ *   usage: lookup_tool [-n lookups] [-p policy] [-t threads] [-w writes]
+ *
+ * Every object has a one byte body so that all of them fit in
+ * MAX_CACHE_SIZE, but 100k entries still need a bigger slab arena than
+ * the proxy's. Build it with cache.c, policy.c, slab.c, disk.c, fresh.c,
+ * relay.c, csapp.c and -DSLAB_ARENA_SIZE=67108864; it is not part of
+ * the proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+#define LOOKUPS 1000000      // timed per cache size by default
+#define MAX_THREADS 32       // most threads looking up at once by default
+#define SHARED_ENTRIES 1000  // entries of the cache the threads share
+
+static const int sizes[] = { 10, 1000, 100000 };
+
+typedef struct {
+  CacheList *cache;
+  char **urls;
+  int nurls;
+  long n;                  // lookups to make
+  int writes;              // percent of them caching the object again
+  unsigned long seed;
+} lookup_arg;
+
+static char **make_urls(const char *dir, int n);
+static void free_urls(char **urls, int n);
+static double time_lookups(CacheList *cache, char **urls, int nurls, long n, int *found);
+static void contention(const cache_policy *policy, long n, int max_threads, int writes);
+static void *lookups(void *vargp);
+static unsigned long next_rand(unsigned long *s);
+
+int main(int argc, char **argv) {
+  const cache_policy *policy = NULL;
+  long n = LOOKUPS;
+  int max_threads = MAX_THREADS, writes = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:p:t:w:")) != -1) {
+    if (opt == 'n') n = atol(optarg);
+    else if (opt == 't') max_threads = atoi(optarg);
+    else if (opt == 'w') writes = atoi(optarg);
+    else if (opt != 'p' || (policy = policy_by_name(optarg)) == NULL) {
+      fprintf(stderr, "usage: %s [-n lookups] [-p %s] [-t threads] [-w writes]\n",
+              argv[0], policy_names());
+      exit(1);
+    }
+  }
+  if (n < 1 || max_threads < 1 || writes < 0 || writes > 100)
+    app_error("bad arguments");
+
+  size_t s;
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int nurls = sizes[s], i, found;
+    char **hits = make_urls("objects", nurls);
+    char **misses = make_urls("missing", nurls);
+
+    CacheList cache;
+    cache_init(&cache, policy);
+    for (i = 0; i < nurls; i++)
+      cache_URL(hits[i], "HTTP/1.0 200 OK\r\n\r\n", Calloc(1, 2), 1, &cache);
+
+    double hit_ns = time_lookups(&cache, hits, nurls, n, &found);
+    double miss_ns = time_lookups(&cache, misses, nurls, n, NULL);
+    printf("%7d entries  hit %6.1f ns  miss %6.1f ns  (%d of them cached)\n",
+           nurls, hit_ns, miss_ns, found);
+    cache_destruct(&cache);
+    free_urls(hits, nurls);
+    free_urls(misses, nurls);
+  }
+
+  contention(policy, n, max_threads, writes);
+  return 0;
+}
+
+// n urls of objects under dir
+static char **make_urls(const char *dir, int n) {
+  char **urls = Malloc(n * sizeof(char *));
+  char url[MAXLINE];
+  int i;
+  for (i = 0; i < n; i++) {
+    snprintf(url, MAXLINE, "http://www.example.com/%s/%d.html", dir, i);
+    urls[i] = strdup(url);
+  }
+  return urls;
+}
+
+static void free_urls(char **urls, int n) {
+  int i;
+  for (i = 0; i < n; i++) free(urls[i]);
+  free(urls);
+}
+
+// ns per find and release of n urls drawn at random. *found, when
+// given, is set to how many of the urls are cached
+static double time_lookups(CacheList *cache, char **urls, int nurls, long n, int *found) {
+  unsigned long seed = 0x9e3779b97f4a7c15UL;
+  struct timespec t0, t1;
+  long i;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < n; i++) {
+    CachedItem *item = find(urls[next_rand(&seed) % nurls], cache);
+    if (item) cache_release(item, cache);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (found) {
+    for (*found = 0, i = 0; i < nurls; i++) {
+      CachedItem *item = find(urls[i], cache);
+      if (item == NULL) continue;
+      (*found)++;
+      cache_release(item, cache);
+    }
+  }
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n;
+}
+
+// n lookups on each of 1, 2, 4 ... max_threads threads sharing a cache,
+// reported as lookups a second of all of them together
+static void contention(const cache_policy *policy, long n, int max_threads, int writes) {
+  char **urls = make_urls("objects", SHARED_ENTRIES);
+  CacheList cache;
+  int i, t;
+
+  cache_init(&cache, policy);
+  for (i = 0; i < SHARED_ENTRIES; i++)
+    cache_URL(urls[i], "HTTP/1.0 200 OK\r\n\r\n", Calloc(1, 2), 1, &cache);
+
+  printf("%d entries shared, %d%% writes\n", SHARED_ENTRIES, writes);
+  pthread_t *tids = Malloc(max_threads * sizeof(pthread_t));
+  lookup_arg *args = Malloc(max_threads * sizeof(lookup_arg));
+  for (t = 1; ; t = (2 * t < max_threads)? 2 * t:max_threads) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < t; i++) {
+      args[i] = (lookup_arg){ &cache, urls, SHARED_ENTRIES, n, writes,
+                              0x9e3779b97f4a7c15UL * (i + 1) };
+      Pthread_create(&tids[i], NULL, lookups, &args[i]);
+    }
+    for (i = 0; i < t; i++) pthread_join(tids[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%3d threads  %10.0f lookups/s\n", t, t * n / secs);
+    if (t == max_threads) break;
+  }
+
+  free(tids);
+  free(args);
+  cache_destruct(&cache);
+  free_urls(urls, SHARED_ENTRIES);
+}
+
+// the lookups of one thread of contention
+static void *lookups(void *vargp) {
+  lookup_arg *a = vargp;
+  long i;
+  for (i = 0; i < a->n; i++) {
+    unsigned long r = next_rand(&a->seed);
+    CachedItem *item = find(a->urls[r % a->nurls], a->cache);
+    if (item == NULL) continue;
+    if ((int)(r >> 40) % 100 < a->writes)
+      cache_replace(item, item->headers, Calloc(1, 2), 1, a->cache);
+    cache_release(item, a->cache);
+  }
+  return NULL;
+}
+
+// xorshift64*
+static unsigned long next_rand(unsigned long *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717UL;
+}
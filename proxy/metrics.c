@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "proxy.h"
+#include "metrics.h"
+#include "accesslog.h"
+
+/*
+ * Counters and latency histograms of the proxy, served as the text
+ * format of Prometheus on the local url /metrics, to clients on the
+ * loopback interface only. Workers only ever add
+ * to them with relaxed atomics, the numbers are read the same way when
+ * a scrape comes, so a scrape may see one counter a little ahead of
+ * another but never stops a request.
+ */
+
+static metrics_t local_metrics;
+metrics_t *metrics = &local_metrics;   // in shared memory after metrics_share
+
+// names of the RESULT_* in the access log
+static const char *result_names[] = {
+  "BAD", "ERROR", "HIT", "STALE", "MISS", "SHARED", "REVALIDATED", "METRICS"
+};
+
+typedef struct {
+  char *p;
+  char *end;
+} out_t;
+
+static void put(out_t *o, const char *fmt, ...);
+static void put_counter(out_t *o, const char *name, unsigned long *v);
+static void put_histogram(out_t *o, const char *name, histogram *h);
+
+
+/* metrics_share moves the numbers into shared memory, to be added up
+ * by every process forked afterwards. Return 0 if succeed, otherwise -1 */
+int metrics_share(void) {
+  metrics_t *m = shared_calloc(sizeof(metrics_t));
+  if (m == NULL) return -1;
+  *m = *metrics;
+  metrics = m;
+  return 0;
+}
+
+// microseconds of the monotonic clock
+long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* histogram_add counts one sample of us microseconds into h */
+void histogram_add(histogram *h, long us) {
+  int i = 0;
+  if (us > METRIC_FIRST_US) {
+    i = 64 - __builtin_clzl((us - 1) / METRIC_FIRST_US);
+    if (i > METRIC_BUCKETS) i = METRIC_BUCKETS;
+  }
+  __atomic_add_fetch(&h->bucket[i], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&h->sum, (us > 0)? us:0, __ATOMIC_RELAXED);
+}
+
+
+/* metrics_request counts a finished request, answered as result (a
+ * RESULT_*) with the given status code and bytes in us microseconds,
+ * and logs it. */
+void metrics_request(int result, int status, const char *uri, size_t bytes, long us) {
+  METRIC_ADD(requests, 1);
+  METRIC_ADD(bytes_sent, bytes);
+  switch (result) {
+    case RESULT_BAD:    METRIC_ADD(bad_requests, 1); break;
+    case RESULT_HIT:    METRIC_ADD(hits, 1); break;
+    case RESULT_STALE:  METRIC_ADD(stale_hits, 1); break;
+    case RESULT_MISS:   METRIC_ADD(misses, 1); break;
+    case RESULT_SHARED: METRIC_ADD(shared, 1); break;
+  }
+  histogram_add(&metrics->latency_us, us);
+  accesslog_add(uri, status, result_names[result], bytes, us);
+}
+
+
+/* metrics_response writes the whole HTTP response to a scrape of
+ * /metrics into buf, with the connection header for this client.
+ * Return its length, or 0 if the body or the response did not fit */
+size_t metrics_response(char *buf, size_t len, CacheList *cache, int keep_alive) {
+  char body[METRICS_BODY];
+  out_t o = { body, body + sizeof(body) };
+
+  put_counter(&o, "proxy_requests_total", &metrics->requests);
+  put_counter(&o, "proxy_cache_hits_total", &metrics->hits);
+  put_counter(&o, "proxy_cache_stale_hits_total", &metrics->stale_hits);
+  put_counter(&o, "proxy_cache_misses_total", &metrics->misses);
+  put_counter(&o, "proxy_shared_fetches_total", &metrics->shared);
+  put_counter(&o, "proxy_revalidated_total", &metrics->revalidated);
+  put_counter(&o, "proxy_bad_requests_total", &metrics->bad_requests);
+  put_counter(&o, "proxy_upstream_errors_total", &metrics->upstream_errors);
+  put_counter(&o, "proxy_bytes_sent_total", &metrics->bytes_sent);
+  put_counter(&o, "proxy_access_log_dropped_total", &metrics->log_dropped);
+  put_counter(&o, "proxy_read_timeouts_total", &metrics->read_timeouts);
+  put_counter(&o, "proxy_write_timeouts_total", &metrics->write_timeouts);
+  put_counter(&o, "proxy_idle_timeouts_total", &metrics->idle_timeouts);
+  put_counter(&o, "proxy_compressed_total", &metrics->compressed);
+  put_counter(&o, "proxy_compress_saved_bytes_total", &metrics->compress_saved);
+  put_counter(&o, "proxy_warmed_total", &metrics->warmed);
+  put_counter(&o, "proxy_cache_evictions_total", &cache->evictions);
+  put_counter(&o, "proxy_cache_disk_promotions_total", &cache->promotions);
+
+  // gauges of the cache, the shard counts are read without their locks
+  size_t items = 0;
+  int i;
+  for (i = 0; i < CACHE_SHARDS; i++)
+    items += __atomic_load_n(&cache->shards[i].count, __ATOMIC_RELAXED);
+  put(&o, "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %zu\n",
+      __atomic_load_n(&cache->size, __ATOMIC_RELAXED));
+  put(&o, "# TYPE proxy_cache_items gauge\nproxy_cache_items %zu\n", items);
+
+  put_histogram(&o, "proxy_upstream_connect_us", &metrics->connect_us);
+  put_histogram(&o, "proxy_upstream_ttfb_us", &metrics->ttfb_us);
+  put_histogram(&o, "proxy_request_latency_us", &metrics->latency_us);
+
+  if (o.p == o.end - 1) return 0;   // cut short
+  int n = snprintf(buf, len, "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n%s%s",
+                   (size_t)(o.p - body), keep_alive? keepalive_hdr:close_hdr, body);
+  return (n < 0 || (size_t)n >= len)? 0:n;
+}
+
+
+// append to the body, keeping what fits
+static void put(out_t *o, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(o->p, o->end - o->p, fmt, ap);
+  va_end(ap);
+  if (n < 0) return;
+  o->p = (n < o->end - o->p)? o->p + n:o->end - 1;
+}
+
+static void put_counter(out_t *o, const char *name, unsigned long *v) {
+  put(o, "# TYPE %s counter\n%s %lu\n", name, name, __atomic_load_n(v, __ATOMIC_RELAXED));
+}
+
+// buckets of a prometheus histogram count every sample up to their
+// bound, so they are summed on the way
+static void put_histogram(out_t *o, const char *name, histogram *h) {
+  unsigned long total = 0;
+  int i;
+
+  put(o, "# TYPE %s histogram\n", name);
+  for (i = 0; i < METRIC_BUCKETS; i++) {
+    total += __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    put(o, "%s_bucket{le=\"%ld\"} %lu\n", name, (long)METRIC_FIRST_US << i, total);
+  }
+  total += __atomic_load_n(&h->bucket[METRIC_BUCKETS], __ATOMIC_RELAXED);
+  put(o, "%s_bucket{le=\"+Inf\"} %lu\n", name, total);
+  put(o, "%s_sum %lu\n%s_count %lu\n", name, __atomic_load_n(&h->sum, __ATOMIC_RELAXED),
+      name, total);
+}
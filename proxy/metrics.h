@@ -0,0 +1,65 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stddef.h>
+#include "cache.h"
+
+#define METRIC_BUCKETS 21   // histogram buckets of 8us, 16us, ... 8s
+#define METRIC_FIRST_US 8   // upper bound of the first bucket
+#define METRICS_BODY 7680   // room for the body of a scrape
+#define METRICS_RESPONSE (METRICS_BODY + 256)   // and the whole response, which
+                                                // fits the buffer of a connection
+
+/* a latency histogram in microseconds */
+typedef struct {
+  unsigned long bucket[METRIC_BUCKETS + 1];  // the last one is past 8s
+  unsigned long sum;
+} histogram;
+
+/* numbers of the whole proxy. Every field only grows, with atomic adds
+ * from any thread, and nothing takes a lock to update them. */
+typedef struct {
+  unsigned long requests;
+  unsigned long hits;              // answered from the cache, fresh
+  unsigned long stale_hits;        // answered stale while revalidated
+  unsigned long misses;            // fetched from the server
+  unsigned long shared;            // answered from another request's fetch
+  unsigned long revalidated;       // 304 to a conditional request
+  unsigned long bad_requests;
+  unsigned long upstream_errors;   // could not reach the server
+  unsigned long bytes_sent;        // response bytes written to clients
+  unsigned long log_dropped;       // access log records lost to a full ring
+  unsigned long read_timeouts;     // dropped waiting for a request or a server
+  unsigned long write_timeouts;    // dropped waiting for a client to read
+  unsigned long idle_timeouts;     // dropped waiting for another request
+  unsigned long compressed;        // gzip variants cached by the compressor
+  unsigned long compress_saved;    // bytes those are smaller than the plain ones
+  unsigned long warmed;            // objects cached by the warm-up
+  histogram connect_us;            // getting a server connection
+  histogram ttfb_us;               // request sent until the status line came
+  histogram latency_us;            // whole requests, as clients see them
+} metrics_t;
+
+/* how a request was answered */
+enum {
+  RESULT_BAD,           // not a request the proxy serves
+  RESULT_ERROR,         // the server or the client failed midway
+  RESULT_HIT,
+  RESULT_STALE,
+  RESULT_MISS,
+  RESULT_SHARED,
+  RESULT_REVALIDATED,   // the cached copy, after the server's 304
+  RESULT_METRICS        // a scrape of /metrics
+};
+
+extern metrics_t *metrics;
+
+#define METRIC_ADD(field, n) __atomic_add_fetch(&metrics->field, (n), __ATOMIC_RELAXED)
+
+int metrics_share(void);
+long now_us(void);
+void histogram_add(histogram *h, long us);
+void metrics_request(int result, int status, const char *uri, size_t bytes, long us);
+size_t metrics_response(char *buf, size_t len, CacheList *cache, int keep_alive);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,93 @@
+/*
+ * parse_tool - measure the header parser (http.c) in MB/s.
+ *
+ *   usage: parse_tool [iterations]
+ *
+ * Parses a request like a browser's and a response header block over
+ * and over, each kept in a buffer the way the proxy reads them. Build it
+ * with http.c; it is not part of the proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+static const char request[] =
+  "GET http://www.example.com/assets/app.js?v=1234 HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+  "Accept: */*\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Referer: http://www.example.com/index.html\r\n"
+  "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en\r\n"
+  "Proxy-Connection: keep-alive\r\n"
+  "If-Modified-Since: Tue, 14 Oct 2026 08:00:00 GMT\r\n"
+  "If-None-Match: \"5f3a-1b2c3d4e\"\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+static const char response[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Date: Thu, 16 Oct 2026 08:00:00 GMT\r\n"
+  "Server: Apache/2.4.58 (Unix)\r\n"
+  "Last-Modified: Tue, 14 Oct 2026 08:00:00 GMT\r\n"
+  "ETag: \"5f3a-1b2c3d4e\"\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Content-Length: 24378\r\n"
+  "Cache-Control: public, max-age=3600\r\n"
+  "Content-Type: application/javascript\r\n"
+  "Keep-Alive: timeout=5, max=100\r\n"
+  "Connection: Keep-Alive\r\n"
+  "\r\n";
+
+static double seconds(void);
+
+int main(int argc, char **argv) {
+  long n = (argc > 1)? atol(argv[1]):DEFAULT_ITERATIONS;
+  http_request r;
+  http_header h;
+  long i, seen = 0;
+
+  // a request block at a time
+  double start = seconds();
+  for (i = 0; i < n; i++) {
+    if (http_parse_request(request, sizeof(request) - 1, &r) <= 0) {
+      fprintf(stderr, "request not parsed\n");
+      exit(1);
+    }
+    seen += r.nheaders;
+  }
+  double t = seconds() - start;
+  printf("request:  %4zu bytes, %5.0f ns each, %6.0f MB/s\n", sizeof(request) - 1,
+         t * 1e9 / n, (sizeof(request) - 1) * n / t / 1e6);
+
+  // a response a line at a time, past its status line
+  const char *body = strchr(response, '\n') + 1;
+  size_t len = sizeof(response) - 1 - (body - response);
+  start = seconds();
+  for (i = 0; i < n; i++) {
+    const char *p = body;
+    size_t left = len;
+    while (*p != '\r') {
+      size_t used = http_parse_header(p, left, &h);
+      seen += h.id;
+      p += used;
+      left -= used;
+    }
+  }
+  t = seconds() - start;
+  printf("response: %4zu bytes, %5.0f ns each, %6.0f MB/s\n", len,
+         t * 1e9 / n, len * n / t / 1e6);
+
+  return seen == 0;
+}
+
+static double seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
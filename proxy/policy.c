@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+#include "policy.h"
+
+/*
+ * Eviction policies for the cache shards. Each keeps its queues as
+ * circular lists whose head is the oldest item; new items go in just
+ * behind the head, so they are examined last.
+ *
+ *   clock    one queue, a hit sets a bit that buys one more pass
+ *   lru      one queue, a hit moves the item to the back
+ *   s3fifo   new items wait in a small probation queue; only those hit
+ *            there move on to the main queue, the rest leave early and
+ *            are remembered in a ghost list to go straight to main
+ *            when they come back
+ *   tinylfu  clock, but a new item is only admitted if it was asked for
+ *            more often than each item it would push out
+ */
+
+#define S3_SMALL_PERCENT 10   // share of the shard kept for probation
+#define S3_MAX_FREQ 3
+#define S3_MAIN 0
+#define S3_SMALL 1
+
+static void clock_insert(CachedItem *item, CacheShard *shard);
+static void clock_hit(CachedItem *item, CacheShard *shard);
+static CachedItem *clock_victim(CacheShard *shard);
+static void clock_remove(CachedItem *item, CacheShard *shard);
+static void lru_hit(CachedItem *item, CacheShard *shard);
+static CachedItem *lru_victim(CacheShard *shard);
+static void s3_insert(CachedItem *item, CacheShard *shard);
+static void s3_hit(CachedItem *item, CacheShard *shard);
+static CachedItem *s3_victim(CacheShard *shard);
+static void s3_remove(CachedItem *item, CacheShard *shard);
+static int ghost_take(CacheShard *shard, unsigned long hash);
+
+const cache_policy clock_policy = {
+  "clock", 0, 0, clock_insert, clock_hit, clock_victim, clock_remove
+};
+const cache_policy lru_policy = {
+  "lru", 1, 0, clock_insert, lru_hit, lru_victim, clock_remove
+};
+const cache_policy s3fifo_policy = {
+  "s3fifo", 0, 0, s3_insert, s3_hit, s3_victim, s3_remove
+};
+const cache_policy tinylfu_policy = {
+  "tinylfu", 0, 1, clock_insert, clock_hit, clock_victim, clock_remove
+};
+
+static const cache_policy *policies[] = {
+  &clock_policy, &lru_policy, &s3fifo_policy, &tinylfu_policy, NULL
+};
+
+
+/* policy_by_name returns the policy called name, or NULL. */
+const cache_policy *policy_by_name(const char *name) {
+  int i;
+  for (i = 0; policies[i]; i++) {
+    if (!strcmp(policies[i]->name, name)) return policies[i];
+  }
+  return NULL;
+}
+
+/* policy_names returns the names of all policies, for usage messages. */
+const char *policy_names(void) {
+  return "clock|lru|s3fifo|tinylfu";
+}
+
+
+/* clock: the hand is the oldest item, hits only set its bit */
+static void clock_insert(CachedItem *item, CacheShard *shard) {
+  ring_insert(item, &shard->hand);
+}
+
+static void clock_hit(CachedItem *item, CacheShard *shard) {
+  __atomic_store_n(&item->freq, 1, __ATOMIC_RELAXED);
+}
+
+// advance the hand past referenced items, clearing their bits
+static CachedItem *clock_victim(CacheShard *shard) {
+  while (shard->hand) {
+    CachedItem *temp = shard->hand;
+    if (!__atomic_exchange_n(&temp->freq, 0, __ATOMIC_RELAXED)) return temp;
+    shard->hand = temp->next;   // second chance
+  }
+  return NULL;
+}
+
+static void clock_remove(CachedItem *item, CacheShard *shard) {
+  ring_remove(item, &shard->hand);
+}
+
+
+/* lru: the same queue, in exact order of use */
+static void lru_hit(CachedItem *item, CacheShard *shard) {
+  ring_remove(item, &shard->hand);
+  ring_insert(item, &shard->hand);
+}
+
+static CachedItem *lru_victim(CacheShard *shard) {
+  return shard->hand;
+}
+
+
+/* s3fifo: hand is the main queue, small the probation queue */
+static void s3_insert(CachedItem *item, CacheShard *shard) {
+  if (ghost_take(shard, item->hash)) {
+    item->queue = S3_MAIN;
+    ring_insert(item, &shard->hand);
+  } else {
+    item->queue = S3_SMALL;
+    ring_insert(item, &shard->small);
+    shard->small_bytes += item->size;
+  }
+}
+
+// count the hit, up to S3_MAX_FREQ, without taking the lock exclusively
+static void s3_hit(CachedItem *item, CacheShard *shard) {
+  int freq = __atomic_load_n(&item->freq, __ATOMIC_RELAXED);
+  while (freq < S3_MAX_FREQ &&
+         !__atomic_compare_exchange_n(&item->freq, &freq, freq + 1, 0,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* s3_victim takes from the probation queue while it holds more than its
+ * share, moving items that were hit more than once to the main queue.
+ * The main queue is a CLOCK whose items survive one pass per hit. */
+static CachedItem *s3_victim(CacheShard *shard) {
+  while (shard->small || shard->hand) {
+    if (shard->small && (shard->hand == NULL ||
+        shard->small_bytes * 100 > shard->bytes * S3_SMALL_PERCENT)) {
+      CachedItem *temp = shard->small;
+      if (__atomic_load_n(&temp->freq, __ATOMIC_RELAXED) <= 1) return temp;
+      ring_remove(temp, &shard->small);
+      shard->small_bytes -= temp->size;
+      __atomic_store_n(&temp->freq, 0, __ATOMIC_RELAXED);
+      temp->queue = S3_MAIN;
+      ring_insert(temp, &shard->hand);
+      continue;
+    }
+
+    CachedItem *temp = shard->hand;
+    int freq = __atomic_load_n(&temp->freq, __ATOMIC_RELAXED);
+    if (freq == 0) return temp;
+    __atomic_store_n(&temp->freq, freq - 1, __ATOMIC_RELAXED);
+    shard->hand = temp->next;
+  }
+  return NULL;
+}
+
+// items leaving probation unused are remembered in the ghost list
+static void s3_remove(CachedItem *item, CacheShard *shard) {
+  if (item->queue == S3_MAIN) {
+    ring_remove(item, &shard->hand);
+    return;
+  }
+  ring_remove(item, &shard->small);
+  shard->small_bytes -= item->size;
+  shard->ghost[shard->ghost_next] = item->hash;
+  shard->ghost_next = (shard->ghost_next + 1) % GHOST_ENTRIES;
+}
+
+// return 1 and forget the hash if it is in the ghost list
+static int ghost_take(CacheShard *shard, unsigned long hash) {
+  int i;
+  for (i = 0; i < GHOST_ENTRIES; i++) {
+    if (shard->ghost[i] == hash) {
+      shard->ghost[i] = 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* sketch_add counts one access to hash. Counters are bumped with relaxed
+ * atomics from many readers at once; an update lost to the halving is
+ * of no consequence for an estimate. */
+void sketch_add(freq_sketch *s, unsigned long hash) {
+  int i;
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    unsigned char *c = &s->counts[i][(hash >> (i * 12)) % SKETCH_WIDTH];
+    if (__atomic_load_n(c, __ATOMIC_RELAXED) < 15)
+      __atomic_add_fetch(c, 1, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&s->samples, 1, __ATOMIC_RELAXED) % (SKETCH_WIDTH * 10))
+    return;
+  int j;
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    for (j = 0; j < SKETCH_WIDTH; j++) {
+      unsigned char c = __atomic_load_n(&s->counts[i][j], __ATOMIC_RELAXED);
+      __atomic_store_n(&s->counts[i][j], c >> 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* sketch_estimate returns how often hash was seen, possibly more. */
+int sketch_estimate(freq_sketch *s, unsigned long hash) {
+  int i, min = 15;
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    int c = __atomic_load_n(&s->counts[i][(hash >> (i * 12)) % SKETCH_WIDTH],
+                            __ATOMIC_RELAXED);
+    if (c < min) min = c;
+  }
+  return min;
+}
+
+
+// insert the item just behind the head, so it is examined last
+void ring_insert(CachedItem *item, CachedItem **head) {
+  if (*head == NULL) {
+    item->prev = item->next = item;
+    *head = item;
+    return;
+  }
+  item->next = *head;
+  item->prev = (*head)->prev;
+  item->prev->next = item;
+  (*head)->prev = item;
+}
+
+// take the item out of its ring
+void ring_remove(CachedItem *item, CachedItem **head) {
+  if (item->next == item) {
+    *head = NULL;
+  } else {
+    item->prev->next = item->next;
+    item->next->prev = item->prev;
+    if (*head == item) *head = item->next;
+  }
+  item->next = item->prev = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+/* an eviction policy. Every function runs under the shard lock, hit
+ * under the shared lock unless exclusive_hits is set. */
+struct cache_policy {
+  const char *name;
+  int exclusive_hits;   // hit reorders the queues
+  int admission;        // new items must be more popular than their victims
+  void (*insert)(CachedItem *item, CacheShard *shard);
+  void (*hit)(CachedItem *item, CacheShard *shard);
+  CachedItem *(*victim)(CacheShard *shard);    // next to evict, still queued
+  void (*remove)(CachedItem *item, CacheShard *shard);
+};
+
+extern const cache_policy clock_policy;
+extern const cache_policy lru_policy;
+extern const cache_policy s3fifo_policy;
+extern const cache_policy tinylfu_policy;
+
+const cache_policy *policy_by_name(const char *name);
+const char *policy_names(void);
+
+#define SKETCH_WIDTH 4096   // counters in each row of the sketch
+#define SKETCH_DEPTH 4
+
+/* count-min sketch of recent accesses, halved every
+ * SKETCH_WIDTH * 10 accesses so old popularity fades */
+struct freq_sketch {
+  unsigned char counts[SKETCH_DEPTH][SKETCH_WIDTH];
+  unsigned long samples;
+};
+
+void sketch_add(freq_sketch *s, unsigned long hash);
+int sketch_estimate(freq_sketch *s, unsigned long hash);
+
+void ring_insert(CachedItem *item, CachedItem **head);
+void ring_remove(CachedItem *item, CachedItem **head);
+
+#endif /* __POLICY_H__ */
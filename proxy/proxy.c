@@ -3,18 +3,144 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include "csapp.h"
 #include "cache.h"
+#include "proxy.h"
+#include "relay.h"
+#include "upstream.h"
+#include "flight.h"
+#include "policy.h"
+#include "frame.h"
+#include "fresh.h"
+#include "http.h"
+#include "metrics.h"
+#include "accesslog.h"
+#include "range.h"
+#include "compress.h"
+#include "warm.h"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = " Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
+#define DEFAULT_NTHREADS 16    // worker threads when none is given
+#define SBUF_PER_THREAD 4      // connection queue slots per worker
+#define PIPELINE_DEPTH 16      // pipelined requests parsed ahead per client
+#define READ_TIMEOUT 10        // default seconds of the timeouts of -t
+#define WRITE_TIMEOUT 30
+#define IDLE_TIMEOUT 5
+#define WORKER_RESTART_DELAY 1 // seconds before the workers are restarted
+
+timeouts_t timeouts = { READ_TIMEOUT, WRITE_TIMEOUT, IDLE_TIMEOUT };
+
+const char *keepalive_hdr = "Connection: keep-alive\r\n\r\n";
+const char *close_hdr = "Connection: close\r\n\r\n";
+
+/* bounded buffer of connected descriptors, shared by the
+ * main thread (producer) and the workers (consumers) */
+typedef struct {
+  int *buf;       // buffer array
+  int n;          // maximum number of slots
+  int front;      // buf[(front+1)%n] is first item
+  int rear;       // buf[rear%n] is last item
+  sem_t mutex;    // protects accesses to buf
+  sem_t slots;    // counts available slots
+  sem_t items;    // counts available items
+} sbuf_t;
+
+/* one parsed client request, queued while earlier ones are served */
+typedef struct request {
+  char uri[MAXLINE];
+  char host[MAXLINE];
+  char port[MAXLINE];
+  char path[MAXLINE];
+  char raw[MAXLINE];        // request line and headers as the client sent them
+  size_t raw_len;
+  http_request parsed;      // slices of raw
+  int keep_alive;           // client wants the connection kept open
+  int bad;                  // status to refuse it with, 0 if it is served
+  int revalidate;           // a background revalidation, no client waits
+  int metrics;              // a scrape of our own /metrics
+  int gzip;                 // client takes gzip-encoded bodies
+  long start;               // when it was read, in microseconds
+  int result;               // how it was answered, a RESULT_*
+  int status;               // status code sent back, 0 if none
+  size_t sent;              // bytes written to the client
+  CachedItem *item;         // cache hit pinned while parsing
+  struct request *next;
+} request_t;
+
+/* one segment of an object served by ranges, pinned in the cache or a
+ * copy of its own when it could not be cached */
+typedef struct {
+  long index;               // its first byte is index * RANGE_SEGMENT
+  int status;               // of the origin's answer, 206 or 416
+  char *hdrs;
+  char *body;
+  size_t len;
+  CachedItem *item;         // NULL for a copy, hdrs and body are then ours
+} segment_t;
+
+/* the answer of the origin to a request, its status line read into the
+ * buffers of doit: a whole object where a segment was asked for, which
+ * doit goes on with rather than ask again */
+typedef struct {
+  int fd;                   // the server connection, -1 for none
+  upstream_host *uh;
+  rio_t *rio;               // reading fd
+  char *hdrs;               // MAXLINE bytes, the status line
+  short rt;                 // its length
+} upstream_resp;
+
+static sbuf_t sbuf;          // queue of accepted connections
+static CacheList *cachelist; // cache shared by all workers, in shared
+                             // memory for the processes of -j
+static disk_tier disk;       // second tier of the cache, with -d
+static int stale_window = 0; // -w: seconds a stale item may still be served
+                             // while it is revalidated, unless it says
+static int worker_no = 0;    // which process of -j this is
+static int restarted = 0;    // the -j group was restarted after a death
+static sigset_t stop_signals; // what stop_thread waits for
+static __thread int timed_out; // the request of this thread dropped on a
+                               // socket timeout, for serve_client to count
+
 // function declaration
-void doit(int fd, CacheList* cache);
-int parse_url(const char *url, char *host, char *port, char *path);
-int read_requesthdrs(rio_t *rp, char* buf, char* host);
-int get_headername(char* header, char* buf);
-int change_headervalue(char* header, const char* new_val);
+void *thread(void *vargp);
+void *stop_thread(void *vargp);
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void serve_client(int fd, CacheList *cache);
+request_t *read_request(rio_t *rio, CacheList *cache);
+void free_request(request_t *req, CacheList *cache);
+int request_buffered(rio_t *rio);
+int doit(int fd, request_t *req, CacheList* cache);
+ssize_t send_cached(int fd, CachedItem *item, int keep_alive);
+void revalidate_async(request_t *req);
+void *revalidate_thread(void *vargp);
+int fork_workers(int nprocs, char *port);
+int open_listenfd_reuseport(char *port);
+static pid_t fork_worker(int *fds, int nprocs, int i);
+static long read_block(rio_t *rp, char *buf, size_t cap);
+static ssize_t read_some(rio_t *rp, char *buf, size_t n);
+static void note_timeout(void);
+static void count_timeout(int fd);
+static ssize_t send_hit(int fd, request_t *req, CachedItem *item);
+static int send_upstream(request_t *req, const char *extra, rio_t *rio, char *hdrs,
+                         upstream_host **uh, short *rt);
+static char *read_headers(rio_t *rio, char *hdrs, short rt, resp_flags *rf);
+static int serve_segments(int fd, request_t *req, byte_range r, CacheList *cache,
+                          upstream_resp *whole);
+static int get_segment(request_t *req, long i, segment_t *seg, CacheList *cache,
+                       upstream_resp *whole, size_t *budget);
+static void put_segment(segment_t *seg, CacheList *cache);
+static int has_credentials(const http_request *r);
 
 int main(int argc, char **argv) 
 {
@@ -22,275 +148,1392 @@ int main(int argc, char **argv)
   char hostname[MAXLINE], port[MAXLINE];
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  pthread_t tid;
+  int use_epoll = 0;   // serve with event loops instead of worker threads
+  int nprocs = 1;      // worker processes, each with its own listener
+  int ni_flags = 0;    // flags for the getnameinfo on each client
+  const cache_policy *policy = NULL;   // CLOCK by default
+  char *disk_dir = NULL;               // no disk tier by default
+  char *log_path = NULL;               // no access log by default
+  int use_gzip = 0;    // compress cached objects in the background
+  char *warm_path = NULL;              // no warm-up by default
+  int warm_top = WARM_TOP, warm_rate = WARM_RATE;
+  char *colon;
+  int opt;
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "d:ej:l:np:t:W:w:z")) != -1) {
+    switch (opt) {
+      case 'd':
+        disk_dir = optarg;
+        break;
+      case 'e':
+        use_epoll = 1;
+        break;
+      case 'j':
+        if ((nprocs = atoi(optarg)) <= 0) {
+          fprintf(stderr, "nprocs must be a positive integer\n");
+          exit(1);
+        }
+        break;
+      case 'l':
+        log_path = optarg;
+        break;
+      case 'n':   // numeric client addresses, no reverse lookup
+        ni_flags = NI_NUMERICHOST | NI_NUMERICSERV;
+        break;
+      case 'p':
+        if ((policy = policy_by_name(optarg)) == NULL) {
+          fprintf(stderr, "eviction policy must be one of %s\n", policy_names());
+          exit(1);
+        }
+        break;
+      case 't':
+        if (sscanf(optarg, "%d:%d:%d", &timeouts.read, &timeouts.write, &timeouts.idle) != 3 ||
+            timeouts.read <= 0 || timeouts.write <= 0 || timeouts.idle <= 0) {
+          fprintf(stderr, "timeouts must be read:write:idle seconds\n");
+          exit(1);
+        }
+        break;
+      case 'w':
+        stale_window = atoi(optarg);
+        break;
+      case 'z':
+        use_gzip = 1;
+        break;
+      case 'W':   // warm the cache up from a url list or access log
+        warm_path = optarg;
+        if ((colon = strchr(optarg, ':')) == NULL) break;
+        *colon = '\0';
+        if (sscanf(colon + 1, "%d:%d", &warm_top, &warm_rate) < 1 ||
+            warm_top <= 0 || warm_rate <= 0) {
+          fprintf(stderr, "warm-up must be file[:top[:rate]]\n");
+          exit(1);
+        }
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-enz] [-d dir] [-j nprocs] [-l logfile] [-p policy] [-t read:write:idle] [-w secs] [-W file[:top[:rate]]] <port> [nthreads]\n", argv[0]);
+        exit(1);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: %s [-enz] [-d dir] [-j nprocs] [-l logfile] [-p policy] [-t read:write:idle] [-w secs] [-W file[:top[:rate]]] <port> [nthreads]\n", argv[0]);
+    exit(1);
+  }
+
+  int nthreads = DEFAULT_NTHREADS;
+  if (argc == 3 && (nthreads = atoi(argv[2])) <= 0) {
+    fprintf(stderr, "nthreads must be a positive integer\n");
+    exit(1);
+  }
+
+  // the disk tier's index and log offsets are private to a process
+  if (disk_dir && nprocs > 1) {
+    fprintf(stderr, "-d can't be combined with -j\n");
     exit(1);
   }
 
   Signal(SIGPIPE, SIG_IGN);
-  CacheList cachelist;
-  cache_init(&cachelist);
+  if (nprocs > 1) {
+    if ((cachelist = cache_init_shared(policy)) == NULL) unix_error("cache_init_shared error");
+    if (metrics_share() < 0) unix_error("metrics_share error");
+  } else {
+    cachelist = Malloc(sizeof(CacheList));
+    cache_init(cachelist, policy);
+  }
+  if (disk_dir) {
+    // SIGTERM and SIGINT are left to a thread of their own, which gets
+    // the disk tier's writes done before exiting
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    if (disk_open(&disk, disk_dir) < 0) unix_error("disk_open error");
+    if (cache_attach_disk(cachelist, &disk) < 0) unix_error("cache_attach_disk error");
+    Pthread_create(&tid, NULL, stop_thread, NULL);
+  }
+
+  // with -j the processes are forked before any thread is started, and
+  // only the workers come back, each with its own listener
+  listenfd = (nprocs > 1)? fork_workers(nprocs, argv[1]):Open_listenfd(argv[1]);
+  if (log_path && accesslog_open(log_path) < 0) unix_error("accesslog_open error");
+  if (use_gzip && compress_start(cachelist) < 0) unix_error("compress_start error");
+
+  // one process warms the cache the others share, and only the first
+  // time: a group restarted on every death would fetch the list again
+  if (warm_path && worker_no == 0 && !restarted &&
+      warm_start(warm_path, warm_top, warm_rate, cachelist) < 0)
+    unix_error("warm_start error");
+
+  // with -e each thread runs its own epoll loop, and never returns
+  if (use_epoll) {
+    event_loops(listenfd, nthreads, cachelist);
+    exit(0);
+  }
+
+  // create the worker threads
+  sbuf_init(&sbuf, nthreads * SBUF_PER_THREAD);
+  int i;
+  for (i = 0; i < nthreads; i++)
+    Pthread_create(&tid, NULL, thread, NULL);
 
-  listenfd = Open_listenfd(argv[1]);
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = accept(listenfd, (SA *)&clientaddr, &clientlen); 
     if (connfd == -1) continue;
 
+    // a kept connection ends each response with a small segment, which
+    // Nagle would hold until the client's delayed ack of the one before.
+    // Headers are corked with MSG_MORE instead.
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
     int rt;
     if ((rt = getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-        port, MAXLINE, 0)) != 0) {
+        port, MAXLINE, ni_flags)) != 0) {
       printf("getnameinfo Error: %s\n", gai_strerror(rt));
       close(connfd);
       continue;
     }
     printf("Accepted connection from (%s, %s)\n", hostname, port);
-    doit(connfd, &cachelist);                                             
-    close(connfd);                                            
+    sbuf_insert(&sbuf, connfd);  // blocks while every slot is taken
+  }
+}
+
+/*
+ * fork_workers - fork nprocs worker processes, each serving the port on
+ * a listener of its own, between which the kernel spreads connections
+ * with SO_REUSEPORT. The listeners are opened up front and kept by the
+ * parent, which only waits. When a worker dies, the others are killed
+ * and all of them started again on an emptied cache, taking over their
+ * listeners with the connections queued there meanwhile. The locks of
+ * the shared cache are not robust, and a dead worker may hold one or
+ * pin items forever; restarting the group is simpler than recovering
+ * every lock and reference. Workers go down with the parent.
+ * Only returns in a worker, with its listener
+ */
+int fork_workers(int nprocs, char *port)
+{
+  int *fds = Malloc(nprocs * sizeof(int));
+  pid_t *pids = Malloc(nprocs * sizeof(pid_t));
+  int i;
+
+  for (i = 0; i < nprocs; i++) {
+    if ((fds[i] = open_listenfd_reuseport(port)) < 0) unix_error("open_listenfd_reuseport error");
+  }
+  for (i = 0; i < nprocs; i++) {
+    if ((pids[i] = fork_worker(fds, nprocs, i)) == 0) return fds[i];
+  }
+
+  // wait for a worker to die, then restart the group
+  while (1) {
+    pid_t pid = wait(NULL);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      unix_error("wait error");
+    }
+    for (i = 0; i < nprocs && pids[i] != pid; i++)
+      ;
+    if (i == nprocs) continue;
+    fprintf(stderr, "worker %d exited, restarting all %d\n", (int)pid, nprocs);
+    pids[i] = 0;
+    for (i = 0; i < nprocs; i++) {
+      if (pids[i] > 0) kill(pids[i], SIGKILL);
+    }
+    for (i = 0; i < nprocs; i++) {
+      while (pids[i] > 0 && waitpid(pids[i], NULL, 0) < 0 && errno == EINTR)
+        ;
+    }
+    cache_reset_shared(cachelist);
+    restarted = 1;
+    sleep(WORKER_RESTART_DELAY);
+    for (i = 0; i < nprocs; i++) {
+      if ((pids[i] = fork_worker(fds, nprocs, i)) == 0) return fds[i];
+    }
   }
 }
 
 /*
- * doit - handle one HTTP request/response transaction
+ * fork_worker - fork the worker serving listener fds[i]. It keeps only
+ * that listener, and is sent SIGTERM when the parent dies.
+ * Return the pid in the parent, 0 in the worker
  */
-void doit(int fd, CacheList* cache) 
+static pid_t fork_worker(int *fds, int nprocs, int i)
 {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-  memset(buf, 0, MAXLINE);
-  char host[MAXLINE], port[MAXLINE], path[MAXLINE];
-  rio_t rio, rio_server;
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid < 0) unix_error("fork error");
+  if (pid > 0) return pid;
+
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != parent) exit(0);   // the parent is already gone
+  worker_no = i;
+  int j;
+  for (j = 0; j < nprocs; j++) {
+    if (j != i) close(fds[j]);
+  }
+  return 0;
+}
+
+/*
+ * open_listenfd_reuseport - open_listenfd, but with SO_REUSEPORT, so
+ * that every worker process can listen on the same port
+ */
+int open_listenfd_reuseport(char *port)
+{
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, port, &hints, &listp) != 0) return -1;
+
+  for (p = listp; p; p = p->ai_next) {
+    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(listenfd);
+  }
+  freeaddrinfo(listp);
+  if (p == NULL) return -1;
+  if (listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+/*
+ * thread - worker routine, serves connections taken from sbuf forever
+ */
+void *thread(void *vargp)
+{
+  Pthread_detach(pthread_self());
+  while (1) {
+    int connfd = sbuf_remove(&sbuf);
+    serve_client(connfd, cachelist);
+    close(connfd);
+  }
+  return NULL;
+}
+
+// wait for SIGTERM or SIGINT, then close the disk tier and exit
+void *stop_thread(void *vargp)
+{
+  int sig;
+  (void)vargp;
+  Pthread_detach(pthread_self());
+  sigwait(&stop_signals, &sig);
+  cache_detach_disk(cachelist);
+  exit(0);
+}
+
+// create an empty, bounded, shared FIFO buffer with n slots
+void sbuf_init(sbuf_t *sp, int n)
+{
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  Sem_init(&sp->mutex, 0, 1);
+  Sem_init(&sp->slots, 0, n);
+  Sem_init(&sp->items, 0, 0);
+}
+
+// insert item onto the rear of shared buffer sp
+void sbuf_insert(sbuf_t *sp, int item)
+{
+  P(&sp->slots);
+  P(&sp->mutex);
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  V(&sp->mutex);
+  V(&sp->items);
+}
+
+// remove and return the first item from buffer sp
+int sbuf_remove(sbuf_t *sp)
+{
+  int item;
+  P(&sp->items);
+  P(&sp->mutex);
+  item = sp->buf[(++sp->front) % (sp->n)];
+  V(&sp->mutex);
+  V(&sp->slots);
+  return item;
+}
+
+/*
+ * serve_client - handle every request on one client connection. Requests
+ * the client has already pipelined are parsed ahead, so their cache hits
+ * are pinned at once and go out right after the responses before them.
+ */
+void serve_client(int fd, CacheList *cache)
+{
+  rio_t rio;
+  request_t *head = NULL, *tail = NULL, *req;
+  int queued = 0;
+  int keep_alive = 1;
+
+  // a client that reads slowly must not hold a worker forever: every
+  // write to it fails unless all of it went out within the write timeout
+  // (writev_all), and the server is not read meanwhile, it waits in the
+  // socket buffers
+  rio_readinitb(&rio, fd);
+  while (keep_alive) {
+    if (head == NULL) {
+      if ((req = read_request(&rio, cache)) == NULL) break;
+      head = tail = req;
+      queued = 1;
+    }
+    while (queued < PIPELINE_DEPTH && request_buffered(&rio)) {
+      if ((req = read_request(&rio, cache)) == NULL) break;
+      tail->next = req;
+      tail = req;
+      queued++;
+    }
+
+    req = head;
+    head = req->next;
+    if (head == NULL) tail = NULL;
+    queued--;
+
+    timed_out = 0;
+    if (!doit(fd, req, cache)) {
+      keep_alive = 0;
+      if (timed_out) count_timeout(fd);
+    } else {
+      keep_alive = req->keep_alive;
+    }
+    metrics_request(req->result, req->status, req->uri, req->sent, now_us() - req->start);
+    free_request(req, cache);
+  }
+
+  while (head) {
+    req = head;
+    head = req->next;
+    free_request(req, cache);
+  }
+}
+
+/*
+ * read_request - read and parse one request from the client, and look
+ * it up in the cache. Return NULL when the client is gone.
+ */
+request_t *read_request(rio_t *rio, CacheList *cache)
+{
+  request_t *req = Malloc(sizeof(request_t));
+  req->keep_alive = req->bad = req->revalidate = req->metrics = 0;
+  req->result = RESULT_BAD;
+  req->status = 0;
+  req->sent = 0;
+  req->uri[0] = '\0';
+  req->item = NULL;
+  req->next = NULL;
 
   /* Read request line and headers */
-  rio_readinitb(&rio, fd); 
-  if (!rio_readlineb(&rio, buf, MAXLINE))  
-    return;
-  printf("%s", buf);
-  sscanf(buf, "%s %s %s", method, uri, version);       
-  if (strcasecmp(method, "GET")) {                     
-    printf("Proxy does not implement this method.\n");
-    return;
-  }                 
-
-  // check if the uri is currently cached
-  CachedItem* item = find(uri, cache); 
-  if (item != NULL) {
-    rio_writen(fd, item->headers, strlen(item->headers));
-    rio_writen(fd, item->item_p, item->size);
-    printf("\n\n\nFound!\n\n\n");
-    return;
-  }                                  
-  
+  long len = read_block(rio, req->raw, sizeof(req->raw));
+  if (len <= 0) {
+    free(req);
+    return NULL;
+  }
+  req->raw_len = len;
+  req->start = now_us();
+
+  http_request *r = &req->parsed;
+  long parsed = http_parse_request(req->raw, len, r);
+  if (parsed <= 0) {
+    req->bad = (parsed == HTTP_TOO_MANY)? 431:400;
+    return req;
+  }
+  if (!http_slice_is(r->method, "GET")) {
+    req->bad = 501;   // not a method this proxy implements
+    return req;
+  }
+  memcpy(req->uri, r->uri.p, r->uri.len);
+  req->uri[r->uri.len] = '\0';
+
   /* Parse URI from GET request, and make sure the url
-     is using http protocol */
-  if (!parse_url(uri, host, port, path)) {
-    printf("This proxy only accept url with http protocol.");
-    return;
+     is using http protocol. Our own /metrics is the only
+     other one served */
+  if (!parse_url(req->uri, req->host, req->port, req->path)) {
+    if (strcmp(req->uri, "/metrics")) {
+      req->bad = 400;
+      return req;
+    }
+    req->metrics = 1;
   }
 
-  // handle request headers
-  memset(buf, 0, MAXLINE);
-  if (!read_requesthdrs(&rio, buf, host)) return;
+  // HTTP/1.1 connections persist unless the client says otherwise
+  req->keep_alive = http_slice_is(r->version, "HTTP/1.1");
+  int i;
+  for (i = 0; i < r->nheaders; i++) {
+    http_header *h = &r->headers[i];
+    if (h->id != HDR_CONNECTION && h->id != HDR_PROXY_CONNECTION) continue;
+    if (http_has_token(h->value, "close")) req->keep_alive = 0;
+    else if (http_has_token(h->value, "keep-alive")) req->keep_alive = 1;
+  }
+
+  req->gzip = accepts_gzip(r);
 
-  // Make a connection with webserver
-  int clientfd;
-  if ((clientfd = open_clientfd(host, port)) < 0) {
-    printf("Unable to connect to server.");
-    return;
+  // check if the uri is currently cached, in the variant the client
+  // takes. One taking gzip is served the plain variant when there is no
+  // other, and has the compressor make the gzip one
+  if (!req->metrics) {
+    char key[MAXLINE + 8];
+    req->item = find(variant_key(key, req->uri, req->gzip), cache);
+    if (req->item == NULL && req->gzip && (req->item = find(req->uri, cache)))
+      compress_async(req->uri, req->item->headers, req->item->size);
   }
+  return req;
+}
 
-  // sending request
-  char request_line[1024];
-  sprintf(request_line, "GET %s HTTP/1.0\r\n", path);
-  rio_writen(clientfd, request_line, strlen(request_line)); // request line
-  rio_writen(clientfd, buf, strlen(buf));                   // headers
-  rio_writen(clientfd, "\r\n", 2);                          // terminating empty line
+// release a request together with the cache hit it pinned
+void free_request(request_t *req, CacheList *cache)
+{
+  if (req->item) cache_release(req->item, cache);
+  free(req);
+}
+
+// read a request line and its headers, up to the empty line, into buf.
+// Whole lines are taken from rio's buffer with memchr and memcpy rather
+// than a byte at a time. Return the length, 0 if the client is gone
+// before sending anything, or -1 if it fails or does not fit in cap
+static long read_block(rio_t *rp, char *buf, size_t cap)
+{
+  size_t len = 0, line = 0;   // line: where the current line starts
+  long deadline = 0;          // ms by which the rest has to come
 
-  printf("=======================================\nrequest headers: %s%s", request_line, buf);    
+  while (1) {
+    size_t n;
+    if (rp->rio_cnt <= 0) {
+      // have rio fill its buffer again, taking the first byte. A request
+      // may take the idle timeout to start, then the read timeout to
+      // come in whole, however slowly it trickles in
+      if (len == cap) return -1;
+      long wait = len? deadline - now_us() / 1000:timeouts.idle * 1000L;
+      struct timeval tv = { wait / 1000, wait % 1000 * 1000 };
+      if (wait <= 0 || setsockopt(rp->rio_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        METRIC_ADD(read_timeouts, 1);
+        return -1;
+      }
+      ssize_t rc = rio_readnb(rp, buf + len, 1);
+      if (rc < 0 && errno == EAGAIN) {
+        if (len) METRIC_ADD(read_timeouts, 1);
+        else METRIC_ADD(idle_timeouts, 1);
+      }
+      if (rc <= 0) return (rc == 0 && len == 0)? 0:-1;
+      n = 1;
+    } else {
+      char *nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt);
+      n = nl? (size_t)(nl + 1 - rp->rio_bufptr):(size_t)rp->rio_cnt;
+      if (len + n > cap) return -1;
+      memcpy(buf + len, rp->rio_bufptr, n);
+      rp->rio_bufptr += n;
+      rp->rio_cnt -= n;
+    }
+    if (len == 0) deadline = now_us() / 1000 + timeouts.read * 1000L;
+    len += n;
 
-  // read response from server
-  memset(buf, 0, MAXLINE);
-  rio_readinitb(&rio_server, clientfd);
-  char header_name[MAXLINE];
-  long content_length = 0;
-  short fl1, fl2, fl3, fl4;   // flags to determine if the response
-  fl1 = fl2 = fl3 = fl4 = 0;  // is qualified to be cached
+    if (buf[len - 1] != '\n') continue;
+    if (line > 0 && (len - line == 1 || (len - line == 2 && buf[line] == '\r')))
+      return len;
+    line = len;
+  }
+}
 
-  char* temp_buf = buf;
-  short rt;
-  while((rt = rio_readlineb(&rio_server, temp_buf, MAXLINE)) > 2) {
-    // get the content-length
-    get_headername(temp_buf, header_name);
-    if (!strncasecmp(header_name, "content-length", strlen(header_name))
-        && strlen(header_name)) {
-      fl2 = !fl2;    
-      content_length = atoi(temp_buf + (strlen("content-length") + 1));
-      if (content_length <= MAX_OBJECT_SIZE) fl3 = !fl3;
+// read up to n bytes, those rp has buffered or else what a single read
+// brings, without waiting for more to make up n. Return as rio_readnb
+static ssize_t read_some(rio_t *rp, char *buf, size_t n)
+{
+  ssize_t rc;
+  if (rp->rio_cnt <= 0) {
+    while ((rc = read(rp->rio_fd, buf, n)) < 0 && errno == EINTR)
+      ;
+    if (rc < 0) note_timeout();
+    return rc;
+  }
+  if ((size_t)rp->rio_cnt < n) n = rp->rio_cnt;
+  memcpy(buf, rp->rio_bufptr, n);
+  rp->rio_bufptr += n;
+  rp->rio_cnt -= n;
+  return n;
+}
+
+// note a socket that failed just now if it timed out, which drops the
+// request unlike other failures
+static void note_timeout(void)
+{
+  if (errno == EAGAIN) timed_out = 1;
+}
+
+// count a request dropped by a socket timeout: the client's if it left
+// some of the response unread, otherwise the server's
+static void count_timeout(int fd)
+{
+  int unsent = 0;
+  if (ioctl(fd, SIOCOUTQ, &unsent) == 0 && unsent > 0) METRIC_ADD(write_timeouts, 1);
+  else METRIC_ADD(read_timeouts, 1);
+}
+
+// return 1 if rio already holds another complete request
+int request_buffered(rio_t *rio)
+{
+  char *p = rio->rio_bufptr;
+  char *end = p + rio->rio_cnt;
+  for (; p + 1 < end; p++) {
+    if (p[0] != '\n') continue;
+    if (p[1] == '\n' || (p[1] == '\r' && p + 2 < end && p[2] == '\n')) return 1;
+  }
+  return 0;
+}
+
+/*
+ * doit - handle one HTTP request/response transaction. Return 1 if the
+ * client connection can carry another request afterwards. With fd -1
+ * there is no client, the response only goes to the cache.
+ */
+int doit(int fd, request_t *req, CacheList* cache) 
+{
+  rio_t rio_server;
+
+  // refused, and the connection closed as what follows can't be trusted
+  if (req->bad) {
+    char buf[MAXLINE];
+    size_t len = error_response(buf, sizeof(buf), req->bad);
+    if (write_all(fd, buf, len) < 0) return 0;
+    req->status = req->bad;
+    req->sent = len;
+    return 0;
+  }
+  req->result = RESULT_ERROR;   // until it is answered
+  if (req->metrics) {
+    char buf[METRICS_RESPONSE];
+    size_t len = 0;
+    int status = 403;   // not for other hosts
+    if (local_client(fd)) {
+      len = metrics_response(buf, sizeof(buf), cache, req->keep_alive);
+      status = len? 200:500;
     }
+    if (status != 200) len = error_response(buf, sizeof(buf), status);
+    if (write_all(fd, buf, len) < 0) return 0;
+    req->result = (status == 200)? RESULT_METRICS:RESULT_BAD;
+    req->status = status;
+    req->sent = len;
+    return status == 200;
+  }
+
+  // answer from the cache while the item is fresh. A stale one may still
+  // be served for a while as it is revalidated in the background, past
+  // that it is revalidated before answering
+  CachedItem *stale = NULL;
+  if (req->item != NULL) {
+    time_t now = time(NULL);
+    int window = (req->item->swr >= 0)? req->item->swr:stale_window;
+    if (!req->revalidate && now < req->item->expires + window) {
+      req->result = RESULT_HIT;
+      if (now >= req->item->expires) {
+        revalidate_async(req);
+        req->result = RESULT_STALE;
+      }
+      ssize_t n = send_hit(fd, req, req->item);
+      if (n < 0) return 0;
+      req->sent = n;
+      return 1;
+    }
+    stale = req->item;
+  }
 
-    // check the return status
-    if (!strncasecmp(temp_buf, "http", 4)) {
-      if (!strncasecmp(temp_buf + strlen("HTTP/1.0 "), "200 OK", 6)) 
-        fl1 = !fl1;
+  // a range of an object that is not cached whole comes from segments.
+  // One open at the end, or spanning more than RANGE_SEGMENTS_MAX of
+  // them, would cost a round trip a segment: it is forwarded instead, as
+  // several ranges are, for the origin to cut
+  char hdrs[MAXLINE], fwd[MAXLINE / 2];
+  upstream_host *uh;
+  short rt;
+  upstream_resp whole = { -1, NULL, &rio_server, hdrs, 0 };
+  byte_range ranges[RANGE_MAX];
+  int nranges = stale? 0:range_request(&req->parsed, NULL, ranges);
+  int forward = (nranges > 1);
+  if (nranges == 1) {
+    byte_range r = ranges[0];
+    long span = (r.first < 0)? r.last:(r.last < 0)? LONG_MAX:r.last - r.first + 1;
+    if (span > (long)RANGE_SEGMENTS_MAX * RANGE_SEGMENT) {
+      forward = 1;
+    } else {
+      int rc = serve_segments(fd, req, r, cache, &whole);
+      if (rc >= 0) return rc;
     }
-    if (rio_writen(fd, temp_buf, strlen(temp_buf)) < 0) {
-      close(clientfd);
-      return;
+  }
+  if (forward && range_forward(&req->parsed, fwd, sizeof(fwd)) == 0) forward = 0;
+
+  // coalesce with a fetch of the same url already on its way, except for
+  // revalidations and forwarded ranges, which followers could not make
+  // sense of, the whole object an origin sent for a segment, and requests
+  // with credentials, which may be answered for their client alone
+  int leader = 1;
+  char key[MAXLINE + 8];
+  variant_key(key, req->uri, req->gzip);   // gzip may come back
+  flight_t *flight = (stale || forward || whole.fd >= 0 || has_credentials(&req->parsed))?
+                     NULL:flight_join(key, &leader);
+  if (!leader) {
+    int rc = flight_follow(flight, fd, req->keep_alive, &req->sent);
+    if (rc >= 0) {
+      req->result = RESULT_SHARED;
+      return rc;
     }
-    temp_buf += strlen(temp_buf);
+    flight = NULL;   // not shared, fetch it ourselves
   }
 
-  printf("\nresponce headers: %s\n", buf);    
-  
-  if (rt < 0) return;
-  if (rio_writen(fd, temp_buf, 2) < 0) {
-    close(clientfd);
-    return;
+  // ask for the body only if it changed since the stale copy
+  char cond[MAXLINE], val[MAXLINE / 2 - 32];
+  cond[0] = '\0';
+  if (stale && header_value(stale->headers, "etag", val, sizeof(val)))
+    sprintf(cond, "If-None-Match: %s\r\n", val);
+  if (stale && header_value(stale->headers, "last-modified", val, sizeof(val)))
+    sprintf(cond + strlen(cond), "If-Modified-Since: %s\r\n", val);
+  if (req->gzip) strcat(cond, "Accept-Encoding: gzip\r\n");
+  if (forward) strcat(cond, fwd);
+
+  int clientfd = whole.fd;
+  uh = whole.uh;
+  rt = whole.rt;
+  if (clientfd < 0) clientfd = send_upstream(req, cond, &rio_server, hdrs, &uh, &rt);
+  if (clientfd < 0) {
+    if (flight) flight_finish(flight, 0);
+    return 0;
   }
 
-  int hasLength = 1;
-  if (content_length == 0) hasLength = 0;
+  // read response from server, the status line is already in hdrs
+  resp_flags rf;               // flags to determine if the response
+  memset(&rf, 0, sizeof(rf));  // is qualified to be cached
+  short fl4 = 0;
+  int client_gone = (fd < 0);  // client went away while followers still read
+  int reusable = 0;            // upstream connection can go back to the pool
+  int client_ok = 0;           // client connection can carry another request
 
-  // read response body into buf
-  char* binary_buf = (char*)malloc(content_length + 1);
-  long rt_val = rio_readnb(&rio_server, binary_buf, content_length);
-  if (rt_val == content_length && content_length != 0) {
-    fl4 = !fl4;
-  } else if (!hasLength && rt_val > 0) {
-    content_length = rt_val;
-  } else {
-    free(binary_buf);
-    close(clientfd);
-    return;
+  char *temp_buf = read_headers(&rio_server, hdrs, rt, &rf);
+  if (temp_buf == NULL) goto out;
+
+  // the stale copy is still good, serve it for another while
+  if (stale && rf.status == 304) {
+    METRIC_ADD(revalidated, 1);
+    cache_refresh(stale, hdrs);
+    fl4 = 1;
+    reusable = rf.keep_alive && rio_server.rio_cnt == 0;
+    if (req->revalidate) goto out;
+
+    ssize_t n = send_hit(fd, req, stale);
+    if (n < 0) goto out;
+    req->result = RESULT_REVALIDATED;
+    req->sent = n;
+    client_ok = req->keep_alive;
+    goto out;
   }
-  binary_buf[content_length] = '\0'; // add tailing zero
 
-  // forward to client
-  if (rio_writen(fd, binary_buf, content_length) < 0) {
-    free(binary_buf);
-    close(clientfd);
-    return;
+  // the client may keep its connection only if it can tell where this
+  // response ends
+  int framed = rf.fl2 || rf.chunked || !resp_has_body(rf.status);
+  int keep_client = req->keep_alive && framed;
+  const char *conn = keep_client? keepalive_hdr:close_hdr;
+  struct iovec iov[2] = {
+    { hdrs, temp_buf - hdrs },
+    { (char *)conn, strlen(conn) }
+  };
+  frame_t fr;
+  frame_init(&fr, &rf, resp_cacheable(&rf));
+
+  // headers wait for the body with MSG_MORE, as in send_cached
+  if (!client_gone && writev_all(fd, iov, 2, fr.done? 0:MSG_MORE) < 0) goto out;
+  req->result = RESULT_MISS;
+  req->status = rf.status;
+  req->sent = (temp_buf - hdrs) + strlen(conn);
+
+  // followers get the same headers, and the body below as it arrives, if
+  // the cache could keep them: a response that is not the same for every
+  // client is theirs to fetch. Without followers the flight ends here,
+  // and the body may be spliced
+  long shared_len = (rf.fl2 && !rf.chunked)? rf.content_length:-1;
+  if (!resp_has_body(rf.status)) shared_len = 0;
+  if (!resp_cacheable(&rf)) shared_len = -1;
+  if (flight && !flight_headers(flight, hdrs, temp_buf - hdrs, shared_len)) {
+    flight_finish(flight, 0);
+    flight = NULL;
   }
 
-  // do the caching 
-  if (fl1 & fl2 & fl3 & fl4) {
-    cache_URL(uri, buf, binary_buf, content_length, cache);
+  // relay the body chunk by chunk as it arrives, framed by frame.c. A
+  // decoded copy is kept for the cache while the response still
+  // qualifies and fits in MAX_OBJECT_SIZE, it is dropped as soon as it
+  // grows past that.
+
+  char chunk[MAXBUF];
+  if (!fr.done && fr.copy == NULL && flight == NULL && client_gone)
+    goto out;   // nobody to read it
+  if (!fr.done && fr.copy == NULL && flight == NULL && fr.type != FRAME_CHUNKED) {
+    // nothing to keep for the cache: hand out what rio already buffered,
+    // then move the rest socket to socket through a pipe
+    long remaining = (fr.type == FRAME_LENGTH)? fr.remaining:-1;   // -1: until EOF
+    size_t want = rio_server.rio_cnt;
+    if (remaining >= 0 && (long)want > remaining) want = remaining;
+    if (want > 0) {
+      rio_readnb(&rio_server, chunk, want);
+      if (write_all(fd, chunk, want) < 0) goto out;
+      req->sent += want;
+      if (remaining > 0) remaining -= want;
+    }
+    long moved = relay_splice(clientfd, fd, remaining, timeouts.write * 1000);
+    if (moved < 0) note_timeout();
+    fl4 = (moved >= 0);
+    if (moved > 0) req->sent += moved;
   } else {
-    free(binary_buf);
+    while (!fr.done) {
+      // never read past the end of the body, the connection may be reused,
+      // and pass on whatever came in rather than wait for a full chunk
+      size_t want = frame_want(&fr);
+      if (want > sizeof(chunk)) want = sizeof(chunk);
+      ssize_t n = want? read_some(&rio_server, chunk, want):
+                        rio_readlineb(&rio_server, chunk, sizeof(chunk));
+      if (n < 0) break;
+      if (n == 0) {   // a close-delimited body ends here, others are truncated
+        frame_eof(&fr);
+        break;
+      }
+      if ((n = frame_feed(&fr, chunk, n)) < 0) break;
+
+      // forward to client and followers
+      if (flight) flight_append(flight, chunk, n);
+      if (!client_gone && write_all(fd, chunk, n) < 0) {
+        if (flight == NULL) break;
+        client_gone = 1;   // keep fetching for the followers
+      }
+      if (!client_gone) req->sent += n;
+    }
+    fl4 = fr.done;
   }
 
-  close(clientfd);
+  // the upstream connection is reusable only if the body had an explicit
+  // end and nothing beyond it was received
+  reusable = fl4 && rf.keep_alive && framed && rio_server.rio_cnt == 0;
+  client_ok = fl4 && keep_client && !client_gone;
+
+  // do the caching, with headers framing the decoded body by its length
+  if (fl4 && fr.copy) {
+    char *cache_hdrs = frame_headers(hdrs, fr.copy_len);
+    size_t len = fr.copy_len;
+    cache_URL(variant_key(key, req->uri, gzip_encoded(cache_hdrs)), cache_hdrs, fr.copy,
+              len, cache);
+    if (req->gzip) compress_async(req->uri, cache_hdrs, len);
+    free(cache_hdrs);
+  } else {
+    free(fr.copy);
+  }
+
+out:
+  if (flight) flight_finish(flight, fl4);
+  upstream_put(uh, clientfd, reusable);
+  return client_ok;
 }
 
-// read request headers into buf and modify them accordingly.
-int read_requesthdrs(rio_t *rp, char* buf, char* host) {
-  int rt; // return value from readline
-  char header_name[MAXLINE];
-  memset(header_name, 0, MAXLINE);
+/* send_upstream sends the request to its server, on an idle connection
+ * when there is one, with the extra header lines after the client's,
+ * and reads the status line of the response into hdrs, of MAXLINE
+ * bytes, and its length into rt. A pooled connection the server closed
+ * in the meantime fails on the first read, then the request is retried
+ * once on a fresh connection; one that timed out is not. Return the
+ * connection, to be handed back with upstream_put, or -1 */
+static int send_upstream(request_t *req, const char *extra, rio_t *rio, char *hdrs,
+                         upstream_host **uh, short *rt)
+{
+  char request_line[MAXLINE];
+  int len = snprintf(request_line, sizeof(request_line), "GET %s HTTP/1.1\r\n", req->path);
+  if (len < 0 || (size_t)len >= sizeof(request_line)) return -1;
 
-  short has_host = 0;
-  while((rt = rio_readlineb(rp, buf, MAXLINE)) > 2) {
-    if (rt == -1) {
-      *buf = 0;
-      printf("Error on rio_readlineb");
-      return 0;
-    }
-    get_headername(buf, header_name);
-    if (!strncasecmp(header_name, "host", strlen(header_name))) {
-      has_host = 1;
-    } 
-    else if (!strncasecmp(header_name, "user-agent", strlen(header_name))) {
-      change_headervalue(buf, user_agent_hdr);
-      rt = strlen(buf);
+  struct iovec req_iov[REWRITE_IOV + 3];
+  int clientfd = -1;
+  int fresh;
+  for (fresh = 0; fresh < 2 && clientfd < 0; fresh++) {
+    long t = now_us();
+    if ((clientfd = upstream_get(req->host, req->port, fresh, uh)) < 0) {
+      METRIC_ADD(upstream_errors, 1);
+      return -1;
     }
-    else if (!strncasecmp(header_name, "connection", strlen(header_name)) ||
-              !strncasecmp(header_name, "proxy-connection", strlen(header_name)))
-    {
-      change_headervalue(buf, " close\r\n");
-      rt = strlen(buf);
+    histogram_add(&metrics->connect_us, now_us() - t);
+
+    // sending request: the request line, the client's headers rewritten
+    // as slices of its request, then ours, in one writev
+    int cnt = 0;
+    req_iov[cnt++] = (struct iovec){ request_line, len };
+    cnt += rewrite_request(&req->parsed, req->host, req_iov + cnt);
+    req_iov[cnt++] = (struct iovec){ (char *)extra, strlen(extra) };
+    req_iov[cnt++] = (struct iovec){ "Connection: keep-alive\r\n\r\n", 26 };
+    errno = 0;   // a server closing on us sets none
+    if (writev_all(clientfd, req_iov, cnt, 0) == 0) {
+      rio_readinitb(rio, clientfd);
+      t = now_us();
+      if ((*rt = rio_readlineb(rio, hdrs, MAXLINE)) > 0) {
+        histogram_add(&metrics->ttfb_us, now_us() - t);
+        return clientfd;
+      }
     }
-    else if (!strncasecmp(header_name, "If-Modified-Since", strlen(header_name)) ||
-              !strncasecmp(header_name, "If-None-Match", strlen(header_name)))
-    {
-      *buf = '\0';
-      continue; // skip these two headers
-    } 
+    int timed = (errno == EAGAIN);
+    note_timeout();
+    upstream_put(*uh, clientfd, 0);
+    if (timed) return -1;   // timed out, not closed: no retry
+    clientfd = -1;
+  }
+  return -1;
+}
+
+/* read_headers reads the response headers after the status line of rt
+ * bytes in hdrs, noting them in rf. Return the end of the headers kept,
+ * where the empty line is, or NULL if they are too long or cut short */
+static char *read_headers(rio_t *rio, char *hdrs, short rt, resp_flags *rf)
+{
+  char *temp_buf = hdrs;
+  while (rt > 2) {
+    temp_buf += resp_header(temp_buf, rt, rf);
 
-    buf += rt;
+    if (hdrs + MAXLINE - temp_buf < 3) return NULL;   // headers too long
+    rt = rio_readlineb(rio, temp_buf, hdrs + MAXLINE - temp_buf);
+    if (rt < 0) note_timeout();
   }
+  return (rt < 2)? NULL:temp_buf;
+}
 
-  if (!has_host) {
-    char host_header[MAXLINE];
-    sprintf(host_header, "host: %s\r\n", host);
-    strncpy(buf, host_header, strlen(host)+1);
+/* serve_segments answers a request for the single range r of an object
+ * not cached whole. The object is fetched and cached in segments of
+ * RANGE_SEGMENT bytes, each with a range request of its own, so a range
+ * of an object too large for the cache, or only ever read in pieces,
+ * costs the segments it covers. Return as doit does, or -1 before
+ * anything is sent if the whole object is to be fetched instead: the
+ * origin does not serve ranges, or the If-Range does not hold. If the
+ * origin sent the whole object already, whole is set to its answer */
+static int serve_segments(int fd, request_t *req, byte_range r, CacheList *cache,
+                          upstream_resp *whole)
+{
+  segment_t seg;
+  int fetched;
+  size_t budget = RANGE_CACHE_MAX;   // so that one request can't flush the cache
+
+  // the size of the object comes with any segment, a suffix range needs
+  // it to know where it starts
+  long i = (r.first >= 0)? r.first / RANGE_SEGMENT:0;
+  if ((fetched = get_segment(req, i, &seg, cache, whole, &budget)) < 0) return -1;
+  long total = range_total(seg.hdrs);
+  byte_range ranges[RANGE_MAX];
+  if (total < 0 || range_request(&req->parsed, seg.hdrs, ranges) != 1) {
+    put_segment(&seg, cache);
+    return -1;
   }
-  return 1;
+
+  const char *conn = req->keep_alive? keepalive_hdr:close_hdr;
+  char buf[RANGE_HDRS];
+  req->result = fetched? RESULT_MISS:RESULT_HIT;
+  if (!range_resolve(&r, total)) {
+    put_segment(&seg, cache);
+    size_t len = range_416(buf, sizeof(buf), total, conn);
+    if (write_all(fd, buf, len) < 0) return 0;
+    req->status = 416;
+    req->sent = len;
+    return 1;
+  }
+  size_t len = range_headers(buf, sizeof(buf), seg.hdrs, &r, total,
+                             r.last - r.first + 1, conn);
+  if (seg.status != 206 || len == 0) {
+    put_segment(&seg, cache);
+    return -1;
+  }
+  struct iovec iov = { buf, len };
+  if (writev_all(fd, &iov, 1, MSG_MORE) < 0) {
+    put_segment(&seg, cache);
+    return 0;
+  }
+  req->status = 206;
+  req->sent = len;
+
+  // then the piece of every segment in the range. A segment that can't be
+  // had now, or is of another version of the object, cuts the response
+  char *first = strdup(seg.hdrs);
+  long pos = r.first;
+  while (pos <= r.last && first) {
+    if (pos / RANGE_SEGMENT != seg.index) {
+      put_segment(&seg, cache);
+      int rc = get_segment(req, pos / RANGE_SEGMENT, &seg, cache, NULL, &budget);
+      if (rc < 0) break;
+      if (rc) req->result = RESULT_MISS;
+      if (seg.status != 206 || !range_same_object(seg.hdrs, first)) break;
+    }
+    long off = pos - seg.index * RANGE_SEGMENT;
+    long n = (long)seg.len - off;
+    if (n > r.last + 1 - pos) n = r.last + 1 - pos;
+    if (n <= 0) break;
+
+    iov = (struct iovec){ seg.body + off, n };
+    if (writev_all(fd, &iov, 1, (pos + n <= r.last)? MSG_MORE:0) < 0) break;
+    pos += n;
+    req->sent += n;
+  }
+  free(first);
+  put_segment(&seg, cache);
+  return pos > r.last;
 }
 
+/* get_segment finds segment i of the object of req in the cache, or
+ * fetches it with a range request and caches it, if it fits in the
+ * *budget of bytes left to cache, which it is taken from. Return 0 if it
+ * was cached, 1 if it was fetched, -1 if the origin did not answer with
+ * that range. A 200 with the whole object instead is handed on in whole
+ * when it is given, its status line read */
+static int get_segment(request_t *req, long i, segment_t *seg, CacheList *cache,
+                       upstream_resp *whole, size_t *budget)
+{
+  char key[MAXLINE + 64], range[64];
+  sprintf(range, "bytes=%ld-%ld", i * RANGE_SEGMENT, (i + 1) * RANGE_SEGMENT - 1);
+  snprintf(key, sizeof(key), "%s\t%s", req->uri, range);
+  memset(seg, 0, sizeof(*seg));
+  seg->index = i;
 
-// return the name of the given header into the buffer
-// Return 1 if succeed, otherwise return 0
-int get_headername(char* header, char* buf) {
-  char* colon = strchr(header, ':');
-  if (colon == NULL) {
-    *buf = '\0';
+  CachedItem *item = find(key, cache);
+  if (item && time(NULL) < item->expires) {
+    seg->item = item;
+    seg->status = 206;
+    seg->hdrs = item->headers;
+    seg->body = item->item_p;
+    seg->len = item->size;
     return 0;
   }
-  strncpy(buf, header, (colon - header));
-  buf[colon-header] = '\0';
+  if (item) cache_release(item, cache);
+
+  char extra[96], line[MAXLINE];
+  rio_t own_rio;
+  rio_t *rio = whole? whole->rio:&own_rio;
+  char *hdrs = whole? whole->hdrs:line;
+  upstream_host *uh;
+  short rt;
+  sprintf(extra, "Range: %s\r\n", range);
+  int clientfd = send_upstream(req, extra, rio, hdrs, &uh, &rt);
+  if (clientfd < 0) return -1;
+
+  // an origin answering with the whole object does not serve ranges
+  resp_flags rf;
+  memset(&rf, 0, sizeof(rf));
+  resp_header(hdrs, rt, &rf);
+  if (rf.status == 200 && whole) {
+    whole->fd = clientfd;
+    whole->uh = uh;
+    whole->rt = rt;
+    return -1;
+  }
+  char *end = read_headers(rio, hdrs, rt, &rf);
+  if (end == NULL || (rf.status != 206 && rf.status != 416)) {
+    upstream_put(uh, clientfd, 0);
+    return -1;
+  }
+
+  // the body of a segment is no larger than the cache takes, a copy of
+  // it is kept whole
+  frame_t fr;
+  char chunk[MAXBUF];
+  frame_init(&fr, &rf, 1);
+  while (!fr.done && fr.copy) {
+    size_t want = frame_want(&fr);
+    if (want > sizeof(chunk)) want = sizeof(chunk);
+    ssize_t n = want? rio_readnb(rio, chunk, want):rio_readlineb(rio, chunk, sizeof(chunk));
+    if (n < 0) {
+      note_timeout();
+      break;
+    }
+    if (n == 0) {
+      frame_eof(&fr);
+      break;
+    }
+    if (frame_feed(&fr, chunk, n) < 0) break;
+  }
+  upstream_put(uh, clientfd, fr.done && rf.keep_alive && fr.type != FRAME_CLOSE &&
+                             rio->rio_cnt == 0);
+  if (!fr.done || fr.copy == NULL) {
+    free(fr.copy);
+    return -1;
+  }
+
+  seg->status = rf.status;
+  seg->hdrs = frame_headers(hdrs, fr.copy_len);
+  seg->body = fr.copy;
+  seg->len = fr.copy_len;
+
+  // some other bytes than the segment asked for are of no use
+  if (rf.status == 206 && range_first(seg->hdrs) != i * RANGE_SEGMENT) {
+    put_segment(seg, cache);
+    return -1;
+  }
+  if (rf.status == 206 && !rf.no_store && !rf.bad_length && fr.copy_len <= *budget) {
+    *budget -= fr.copy_len;
+    char *copy = Malloc(fr.copy_len + 1);
+    memcpy(copy, fr.copy, fr.copy_len);
+    cache_URL(key, seg->hdrs, copy, fr.copy_len, cache);
+  }
   return 1;
 }
 
-// Given a header, change it's value to new value，
-int change_headervalue(char* header, const char* new_val) {
-  char* colon = strchr(header, ':');
-  if (colon == NULL) return 0;
-  char* end = strchr(header, '\n');
-  if (end == NULL) return 0;
+// hand a segment back to the cache, or free the copy
+static void put_segment(segment_t *seg, CacheList *cache)
+{
+  if (seg->item) {
+    cache_release(seg->item, cache);
+  } else {
+    free(seg->hdrs);
+    free(seg->body);
+  }
+  seg->item = NULL;
+  seg->hdrs = seg->body = NULL;
+}
 
-  // compute the number of byte to copy,
-  // which is the max of two length
-  int old_length = (end + 1) - colon;
-  int new_length = strlen(new_val);
-  int length = (new_length > old_length)? new_length:old_length;
+/* revalidate_async revalidates the stale item of req in the background,
+ * unless that is already being done. The copy of the request it runs
+ * holds its own reference to the item. */
+void revalidate_async(request_t *req)
+{
+  pthread_t tid;
+  if (__atomic_exchange_n(&req->item->revalidating, 1, __ATOMIC_ACQ_REL)) return;
 
-  strncpy(colon + 1, new_val, length + 1);
-  return 1;
+  request_t *copy = Malloc(sizeof(request_t));
+  memcpy(copy, req, sizeof(request_t));
+  http_parse_request(copy->raw, copy->raw_len, &copy->parsed);   // slices of its own raw
+  copy->revalidate = 1;
+  copy->keep_alive = 0;
+  copy->next = NULL;
+  cache_hold(copy->item);
+  Pthread_create(&tid, NULL, revalidate_thread, copy);
 }
 
-// Return 1 if succeed, otherwise return 0
-int parse_url(const char *url, char *host, char *port, char *path) {
-  // copy the string into internal buffer
-  char url_buf[1024];
-  strcpy(url_buf, url); 
+// run a revalidation like any request without a client
+void *revalidate_thread(void *vargp)
+{
+  request_t *req = vargp;
+  Pthread_detach(pthread_self());
+  doit(-1, req, cachelist);
+  __atomic_store_n(&req->item->revalidating, 0, __ATOMIC_RELEASE);
+  free_request(req, cachelist);
+  return NULL;
+}
 
-  // if url doesn't contain http at beginning, return 0 
-  if (strncasecmp(url_buf, "http://", strlen("http://"))) return 0;
-  char* host_ptr = url_buf + strlen("http://");
+/* prefetch fetches url into the cache the way a plain GET from a client
+ * would, without the client, unless it is cached already.
+ * Return 1 if it got cached, 0 if it already was, -1 if it can't be */
+int prefetch(const char *url, CacheList *cache)
+{
+  request_t *req = Malloc(sizeof(request_t));
+  memset(req, 0, sizeof(request_t));
+  int rc = -1;
 
-  // if path is found, copy to given path pointer
-  // also replace '/' with '\0' to seperate path
-  // from the rest of url. 
-  char* path_ptr = strchr(host_ptr, '/');
-  if (path_ptr) {
-    strncpy(path, path_ptr, strlen(path_ptr)+1);
-    *path_ptr = '\0';
+  if (strlen(url) + 32 < sizeof(req->raw) && parse_url(url, req->host, req->port, req->path)) {
+    strcpy(req->uri, url);
+    req->raw_len = sprintf(req->raw, "GET %s HTTP/1.1\r\n\r\n", url);
+    http_parse_request(req->raw, req->raw_len, &req->parsed);
+    req->start = now_us();
+    if ((req->item = find(url, cache))) {
+      rc = 0;
+    } else {
+      doit(-1, req, cache);
+      if ((req->item = find(url, cache))) rc = 1;
+    }
   }
-  else { // if path not found, add default '/'
-    strncpy(path, "/", 2);
+  free_request(req, cache);
+  return rc;
+}
+
+/* send_cached writes a cached response: its headers, the connection
+ * header for this client, then its body.
+ * Return the bytes written if succeed, otherwise return -1 */
+ssize_t send_cached(int fd, CachedItem *item, int keep_alive)
+{
+  struct iovec iov[3];
+  int cnt = cached_iov(item, keep_alive, iov);
+  ssize_t len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+
+  // large bodies go straight from the arena's memfd with sendfile. The
+  // headers wait for them with MSG_MORE: sent alone they are a small
+  // segment, and a body ending in another small one is held by Nagle
+  // until the client's delayed ack of the headers, some 40ms later
+  if (item->size >= SENDFILE_MIN && item->body_fd >= 0) {
+    if (writev_all(fd, iov, cnt - 1, MSG_MORE) < 0) return -1;
+    if (sendfile_all(fd, item->body_fd, item->body_off, item->size,
+                     timeouts.write * 1000) == (ssize_t)item->size) return len;
+    note_timeout();
+    return -1;
   }
+  return (writev_all(fd, iov, cnt, 0) < 0)? -1:len;
+}
 
-  // same structure as path.
-  char* port_ptr = strchr(host_ptr, ':');
-  if (port_ptr) {
-    strncpy(port, port_ptr + 1, strlen(port_ptr+1)+1);
-    *port_ptr = '\0';
+/* send_hit answers req from the cached item: with the ranges it asks
+ * for, if it asks for some, otherwise with the whole item.
+ * Return the bytes written if succeed, otherwise return -1 */
+static ssize_t send_hit(int fd, request_t *req, CachedItem *item)
+{
+  byte_range ranges[RANGE_MAX];
+  range_resp rr;
+
+  // a gzipped item, found only for clients taking gzip, goes as it is,
+  // without ranges
+  if (item->gzip) {
+    req->status = 200;
+    return send_cached(fd, item, req->keep_alive);
   }
-  else {
-    strncpy(port, "80", 3);
+
+  int n = range_request(&req->parsed, item->headers, ranges);
+  if (n > 0 && range_response(item, ranges, n, req->keep_alive, &rr)) {
+    req->status = rr.status;
+    return (writev_all(fd, rr.iov, rr.cnt, 0) < 0)? -1:(ssize_t)rr.len;
   }
-  
-  strncpy(host, host_ptr, strlen(host_ptr)+1);
+  req->status = 200;
+  return send_cached(fd, item, req->keep_alive);
+}
+
+/* cached_iov fills iov with the pieces of a cached response. The stored
+ * headers end with the empty line, which goes after our connection
+ * header. Return the number of pieces, the body is always the last */
+int cached_iov(CachedItem *item, int keep_alive, struct iovec *iov)
+{
+  const char *conn = keep_alive? keepalive_hdr:close_hdr;
+  iov[0].iov_base = item->headers;
+  iov[0].iov_len = item->hdr_len - 2;
+  iov[1].iov_base = (char *)conn;
+  iov[1].iov_len = strlen(conn);
+  iov[2].iov_base = item->item_p;
+  iov[2].iov_len = item->size;
+  return 3;
+}
+
+/* writev_all writes every piece of iov to socket fd, continuing after
+ * short writes, with flags for sendmsg. All of it has to go within the
+ * write timeout: a blocking write would start its SO_SNDTIMEO over with
+ * every bit of room it gets, so the socket is written without waiting
+ * and waited on with poll until that deadline.
+ * Return 0 if succeed, otherwise return -1, with errno EAGAIN if it
+ * timed out */
+int writev_all(int fd, struct iovec *iov, int cnt, int flags)
+{
+  long deadline = now_us() + timeouts.write * 1000000L;
+  while (cnt > 0) {
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = cnt };
+    ssize_t n = sendmsg(fd, &msg, flags | MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN && wait_writable(fd, deadline) == 0) continue;
+    if (n < 0) {
+      note_timeout();
+      return -1;
+    }
+
+    // skip what was written
+    while (cnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/* write_all writes the len bytes of buf as writev_all does.
+ * Return 0 if succeed, otherwise return -1 */
+int write_all(int fd, const void *buf, size_t len)
+{
+  struct iovec iov = { (void *)buf, len };
+  return writev_all(fd, &iov, 1, 0);
+}
+
+/* rewrite_request fills iov with the header lines of r to send to the
+ * server, as slices of the client's request. The connection,
+ * conditional, range and accept-encoding headers are left out, the
+ * caller adds its own, the user agent is ours, and a host header is
+ * added if the client sent none.
+ * Lines kept as they are next to each other share a piece.
+ * Return the number of pieces, at most REWRITE_IOV */
+int rewrite_request(const http_request *r, const char *host, struct iovec *iov) {
+  int cnt = 0, has_host = 0, i;
+
+  for (i = 0; i < r->nheaders; i++) {
+    const http_header *h = &r->headers[i];
+    size_t len = h->line.len;
+    switch (h->id) {
+      case HDR_CONNECTION:
+      case HDR_PROXY_CONNECTION:
+      case HDR_KEEP_ALIVE:
+      case HDR_IF_MODIFIED_SINCE:
+      case HDR_IF_NONE_MATCH:
+      case HDR_RANGE:      // whole objects are fetched, ranges cut
+      case HDR_IF_RANGE:   // out of them by the proxy (range.c)
+      case HDR_ACCEPT_ENCODING:   // gzip or nothing (compress.c)
+        continue;
+      case HDR_HOST:
+        has_host = 1;
+        break;
+      case HDR_USER_AGENT:
+        len = h->name.len + 1;   // up to the colon, our value follows
+        break;
+    }
+
+    if (cnt > 0 && (char *)iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == h->line.p)
+      iov[cnt - 1].iov_len += len;
+    else
+      iov[cnt++] = (struct iovec){ (char *)h->line.p, len };
+    if (h->id == HDR_USER_AGENT)
+      iov[cnt++] = (struct iovec){ (char *)user_agent_hdr, strlen(user_agent_hdr) };
+  }
+
+  if (!has_host) {
+    iov[cnt++] = (struct iovec){ "Host: ", 6 };
+    iov[cnt++] = (struct iovec){ (char *)host, strlen(host) };
+    iov[cnt++] = (struct iovec){ "\r\n", 2 };
+  }
+  return cnt;
+}
+
+/* resp_header updates rf with one line of a response, the status line
+ * or a header, of len bytes. Return the length to keep of it, 0 for the
+ * hop-by-hop headers, the proxy sends its own connection header, and
+ * for a content-length that is no length */
+size_t resp_header(const char *line, size_t len, resp_flags *rf) {
+  http_header h;
+
+  // the status line
+  if (len > 9 && !strncasecmp(line, "http/", 5)) {
+    rf->status = atoi(line + strlen("HTTP/1.0 "));
+    rf->fl1 = (rf->status == 200);
+    rf->keep_alive = !strncasecmp(line, "HTTP/1.1", 8);
+    return len;
+  }
+
+  if (http_parse_header(line, len, &h) == 0) return len;
+  switch (h.id) {
+    case HDR_CONTENT_LENGTH: {
+      // a length that is no number, or a negative one, is dropped: the
+      // body ends with the close, and the response is not cached
+      char *end;
+      errno = 0;
+      long cl = strtol(h.value.p, &end, 10);
+      if (h.value.len == 0 || end != h.value.p + h.value.len || cl < 0 || errno == ERANGE) {
+        rf->bad_length = 1;
+        return 0;
+      }
+      rf->fl2 = !rf->fl2;
+      rf->content_length = cl;
+      if (rf->content_length <= MAX_OBJECT_SIZE) rf->fl3 = !rf->fl3;
+      break;
+    }
+    case HDR_TRANSFER_ENCODING:
+      if (http_has_token(h.value, "chunked")) rf->chunked = 1;
+      break;
+    case HDR_CACHE_CONTROL:
+      if (http_has_token(h.value, "no-store") || http_has_token(h.value, "private"))
+        rf->no_store = 1;
+      break;
+    case HDR_VARY:
+      // we ask for gzip or nothing, the only variants the cache keeps apart
+      if (!http_slice_is(h.value, "accept-encoding")) rf->vary = 1;
+      break;
+    case HDR_CONNECTION:
+      if (http_has_token(h.value, "close")) rf->keep_alive = 0;
+      else if (http_has_token(h.value, "keep-alive")) rf->keep_alive = 1;
+      return 0;
+    case HDR_PROXY_CONNECTION:
+    case HDR_KEEP_ALIVE:
+      return 0;
+    case HDR_OTHER:
+      // a cookie set for one client is no one else's
+      if (http_slice_is(h.name, "set-cookie")) rf->no_store = 1;
+      break;
+  }
+  return len;
+}
+
+// return 1 if r carries credentials of its client, which may get it an
+// answer of its own
+static int has_credentials(const http_request *r) {
+  int i;
+  for (i = 0; i < r->nheaders; i++) {
+    const http_header *h = &r->headers[i];
+    if (h->id == HDR_OTHER &&
+        (http_slice_is(h->name, "authorization") || http_slice_is(h->name, "cookie")))
+      return 1;
+  }
+  return 0;
+}
+
+// return 1 if the response may be kept in the cache: a complete 200
+// that fits, that the origin lets a shared cache keep, and that is the
+// same for every client
+int resp_cacheable(const resp_flags *rf) {
+  return rf->fl1 && (!rf->fl2 || rf->fl3) && !rf->no_store && !rf->vary &&
+         !rf->bad_length;
+}
+
+// responses to these status codes never carry a body
+int resp_has_body(int status) {
+  return !((status >= 100 && status < 200) || status == 204 || status == 304);
+}
+
+// write a response refusing a request with status into buf, closing
+// the connection. Return its length
+size_t error_response(char *buf, size_t cap, int status) {
+  const char *reason;
+  switch (status) {
+    case 403: reason = "Forbidden"; break;
+    case 431: reason = "Request Header Fields Too Large"; break;
+    case 500: reason = "Internal Server Error"; break;
+    case 501: reason = "Not Implemented"; break;
+    default:  reason = "Bad Request";
+  }
+  int n = snprintf(buf, cap, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n%s",
+                   status, reason, close_hdr);
+  return (n < 0 || (size_t)n >= cap)? 0:n;
+}
+
+
+// 1 if the client on fd connects from the loopback interface, the only
+// one /metrics is served to
+int local_client(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, (SA *)&addr, &len) < 0) return 0;
+  if (addr.ss_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+  if (addr.ss_family == AF_INET6) {
+    struct in6_addr *a = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+    return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+  }
+  return 0;
+}
+
+// split an http url into its host, port and path, each of which has
+// room for the whole url. Return 1 if succeed, otherwise return 0
+int parse_url(const char *url, char *host, char *port, char *path) {
+  // if url doesn't contain http at beginning, return 0
+  if (strncasecmp(url, "http://", strlen("http://"))) return 0;
+  const char *host_ptr = url + strlen("http://");
+
+  // the path starts at the first '/', "/" if there is none
+  const char *path_ptr = strchr(host_ptr, '/');
+  const char *host_end = path_ptr? path_ptr:host_ptr + strlen(host_ptr);
+  strcpy(path, path_ptr? path_ptr:"/");
+
+  // same for the port, after a ':' in the host part
+  const char *port_ptr = memchr(host_ptr, ':', host_end - host_ptr);
+  if (port_ptr) {
+    memcpy(port, port_ptr + 1, host_end - port_ptr - 1);
+    port[host_end - port_ptr - 1] = '\0';
+    host_end = port_ptr;
+  } else {
+    strcpy(port, "80");
+  }
+
+  memcpy(host, host_ptr, host_end - host_ptr);
+  host[host_end - host_ptr] = '\0';
   return 1;
-}
\ No newline at end of file
+}
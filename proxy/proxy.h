@@ -0,0 +1,61 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+#define REWRITE_IOV (HTTP_MAX_HEADERS * 2 + 3)   // pieces from rewrite_request
+
+/* flags collected from the response headers that decide whether
+ * the response is qualified to be cached, and how its body is framed */
+typedef struct {
+  long content_length;
+  short fl1;          // status is 200 OK
+  short fl2;          // has a content-length header
+  short fl3;          // content-length fits in MAX_OBJECT_SIZE
+  int status;         // status code
+  short chunked;      // transfer-encoding is chunked
+  short keep_alive;   // server keeps the connection open afterwards
+  short no_store;     // cache-control forbids a shared cache to keep it,
+                      // or it sets a cookie
+  short vary;         // varies on request headers besides Accept-Encoding
+  short bad_length;   // has a content-length that is no length
+} resp_flags;
+
+/* deadlines of connections in seconds, set with -t: for a request to
+ * come in whole, or a server to send something, for a client to take
+ * some of what is written to it, and for a kept-alive client to start
+ * its next request */
+typedef struct {
+  int read;
+  int write;
+  int idle;
+} timeouts_t;
+
+extern timeouts_t timeouts;
+
+// connection headers we send to clients, each ending the header block
+extern const char *keepalive_hdr;
+extern const char *close_hdr;
+
+// shared by the thread pool (proxy.c) and the event engine (event.c)
+int parse_url(const char *url, char *host, char *port, char *path);
+int rewrite_request(const http_request *r, const char *host, struct iovec *iov);
+size_t resp_header(const char *line, size_t len, resp_flags *rf);
+int resp_has_body(int status);
+int resp_cacheable(const resp_flags *rf);
+size_t error_response(char *buf, size_t cap, int status);
+int local_client(int fd);
+int cached_iov(CachedItem *item, int keep_alive, struct iovec *iov);
+int writev_all(int fd, struct iovec *iov, int cnt, int flags);
+int write_all(int fd, const void *buf, size_t len);
+
+// proxy.c, for warm.c
+int prefetch(const char *url, CacheList *cache);
+
+// event.c
+void event_loops(int listenfd, int nloops, CacheList *cache);
+
+#endif /* __PROXY_H__ */
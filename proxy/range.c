@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include "proxy.h"
+#include "range.h"
+#include "fresh.h"
+
+/*
+ * Byte ranges (RFC 9110, section 14). The proxy fetches whole objects,
+ * or whole segments of them, and cuts the ranges a client asks for out
+ * of what it has cached: a 206 with the one range, or with several as
+ * multipart/byteranges, or a 416 when none of them is in the object.
+ * Ranges of an object it does not have, that segments would not serve
+ * well, are forwarded for the origin to cut. A Range header the proxy can't make sense of, one with more
+ * than RANGE_MAX ranges, or ranges overlapping into more bytes than the
+ * whole object gets the whole object, as the RFC allows.
+ */
+
+static int parse_ranges(http_slice v, byte_range *ranges);
+static int digits(const char **p, const char *end, long *v);
+static int if_range_holds(http_slice v, const char *hdrs);
+static int skip_line(const char *line, int multipart);
+
+
+/* range_request parses the Range header of r into ranges. With hdrs,
+ * the headers of the cached object, an If-Range naming another version
+ * of it makes the request one for the whole object. Return the number
+ * of ranges, 0 if the whole object is to be sent */
+int range_request(const http_request *r, const char *hdrs, byte_range *ranges) {
+  int i, n = 0;
+  for (i = 0; i < r->nheaders; i++) {
+    const http_header *h = &r->headers[i];
+    if (h->id == HDR_RANGE && (n = parse_ranges(h->value, ranges)) <= 0) return 0;
+  }
+  for (i = 0; n > 0 && hdrs && i < r->nheaders; i++) {
+    const http_header *h = &r->headers[i];
+    if (h->id == HDR_IF_RANGE && !if_range_holds(h->value, hdrs)) return 0;
+  }
+  return n;
+}
+
+
+/* range_resolve turns r into the bytes it covers in an object of size
+ * bytes. Return 1 if some are in the object, 0 if none */
+int range_resolve(byte_range *r, long size) {
+  if (r->first < 0) {   // suffix
+    if (r->last == 0 || size == 0) return 0;
+    r->first = (r->last < size)? size - r->last:0;
+    r->last = size - 1;
+    return 1;
+  }
+  if (r->first >= size) return 0;
+  if (r->last < 0 || r->last >= size) r->last = size - 1;
+  return 1;
+}
+
+
+/* range_total returns the size of the whole object from the
+ * Content-Range header of a 206 in hdrs, -1 if it does not say */
+long range_total(const char *hdrs) {
+  char val[128];
+  if (!header_value(hdrs, "content-range", val, sizeof(val))) return -1;
+  char *slash = strchr(val, '/');
+  if (slash == NULL || slash[1] < '0' || slash[1] > '9') return -1;
+  return atol(slash + 1);
+}
+
+/* range_first returns the first byte of the range in the Content-Range
+ * header of a 206 in hdrs, -1 if it does not say */
+long range_first(const char *hdrs) {
+  char val[128];
+  if (!header_value(hdrs, "content-range", val, sizeof(val))) return -1;
+  if (strncasecmp(val, "bytes ", 6) || val[6] < '0' || val[6] > '9') return -1;
+  return atol(val + 6);
+}
+
+/* range_same_object returns 1 if the 206 headers a and b are of the same
+ * version of an object: of the same size, with the same ETag and
+ * Last-Modified or without them. Otherwise return 0 */
+int range_same_object(const char *a, const char *b) {
+  static const char *validators[] = { "etag", "last-modified" };
+  char va[256], vb[256];
+  size_t i;
+
+  if (range_total(a) != range_total(b)) return 0;
+  for (i = 0; i < sizeof(validators) / sizeof(validators[0]); i++) {
+    int has_a = header_value(a, validators[i], va, sizeof(va));
+    int has_b = header_value(b, validators[i], vb, sizeof(vb));
+    if (has_a != has_b || (has_a && strcmp(va, vb))) return 0;
+  }
+  return 1;
+}
+
+/* range_forward copies the Range and If-Range lines of r into buf, for
+ * a request that leaves cutting the ranges to the origin. Return their
+ * length, or 0 if r has no Range or they do not fit in cap */
+size_t range_forward(const http_request *r, char *buf, size_t cap) {
+  size_t len = 0;
+  int i, has_range = 0;
+  for (i = 0; i < r->nheaders; i++) {
+    const http_header *h = &r->headers[i];
+    if (h->id != HDR_RANGE && h->id != HDR_IF_RANGE) continue;
+    if (len + h->line.len >= cap) return 0;
+    memcpy(buf + len, h->line.p, h->line.len);
+    len += h->line.len;
+    has_range |= (h->id == HDR_RANGE);
+  }
+  buf[len] = '\0';
+  return has_range? len:0;
+}
+
+
+/* range_headers writes the headers of a 206 into buf: those of the
+ * cached response hdrs, with the framing of the range r of an object of
+ * total bytes, or of a multipart/byteranges body if r is NULL, of
+ * body_len bytes, then the connection header conn. Return the length,
+ * or 0 if it does not fit in cap */
+size_t range_headers(char *buf, size_t cap, const char *hdrs, const byte_range *r,
+                     long total, size_t body_len, const char *conn) {
+  size_t len = snprintf(buf, cap, "HTTP/1.1 206 Partial Content\r\n");
+
+  // the stored headers after their status line, up to the empty line
+  const char *line = strchr(hdrs, '\n'), *next;
+  for (line = line? line + 1:""; *line && *line != '\r' && *line != '\n'; line = next) {
+    next = strchr(line, '\n');
+    next = next? next + 1:line + strlen(line);
+    if (skip_line(line, r == NULL)) continue;
+    if (len + (next - line) >= cap) return 0;
+    memcpy(buf + len, line, next - line);
+    len += next - line;
+  }
+
+  int n;
+  if (r)
+    n = snprintf(buf + len, cap - len, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                 "Content-Length: %zu\r\n%s", r->first, r->last, total, body_len, conn);
+  else
+    n = snprintf(buf + len, cap - len, "Content-Type: multipart/byteranges; boundary="
+                 RANGE_BOUNDARY "\r\nContent-Length: %zu\r\n%s", body_len, conn);
+  if (n < 0 || (size_t)n >= cap - len) return 0;
+  return len + n;
+}
+
+/* range_416 writes a 416 response for an object of total bytes into
+ * buf. Return its length */
+size_t range_416(char *buf, size_t cap, long total, const char *conn) {
+  int n = snprintf(buf, cap, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                   "Content-Range: bytes */%ld\r\nContent-Length: 0\r\n%s", total, conn);
+  return (n < 0)? 0:((size_t)n < cap)? (size_t)n:cap - 1;
+}
+
+
+/* range_response makes the response to the n ranges of a request for a
+ * cached item in out: the bodies are pieces of the item, which must
+ * stay pinned until out is written. Return 1 if succeed, 0 if the whole
+ * item is to be sent instead */
+int range_response(CachedItem *item, byte_range *ranges, int n, int keep_alive,
+                   range_resp *out) {
+  const char *conn = keep_alive? keepalive_hdr:close_hdr;
+  long size = item->size;
+  size_t bytes = 0;
+  int i, k = 0;
+
+  // keep the ranges that are in the item
+  for (i = 0; i < n; i++) {
+    if (!range_resolve(&ranges[i], size)) continue;
+    bytes += ranges[i].last - ranges[i].first + 1;
+    ranges[k++] = ranges[i];
+  }
+  if (k == 0) {
+    out->len = range_416(out->buf, sizeof(out->buf), size, conn);
+    out->iov[0] = (struct iovec){ out->buf, out->len };
+    out->cnt = 1;
+    out->status = 416;
+    return 1;
+  }
+  if (bytes > (size_t)size) return 0;
+
+  char *body = item->item_p;
+  out->status = 206;
+  if (k == 1) {
+    size_t h = range_headers(out->buf, RANGE_HDRS, item->headers, &ranges[0], size, bytes, conn);
+    if (h == 0) return 0;
+    out->iov[0] = (struct iovec){ out->buf, h };
+    out->iov[1] = (struct iovec){ body + ranges[0].first, bytes };
+    out->cnt = 2;
+    out->len = h + bytes;
+    return 1;
+  }
+
+  // every part gets headers of its own, written behind the response's
+  char type[96];
+  if (!header_value(item->headers, "content-type", type, sizeof(type)))
+    strcpy(type, "application/octet-stream");
+  char *p = out->buf + RANGE_HDRS;
+  char *end = out->buf + sizeof(out->buf);
+  size_t body_len = bytes;
+  out->cnt = 1;
+  for (i = 0; i < k; i++) {
+    int m = snprintf(p, end - p, "\r\n--" RANGE_BOUNDARY "\r\nContent-Type: %s\r\n"
+                     "Content-Range: bytes %ld-%ld/%ld\r\n\r\n", type,
+                     ranges[i].first, ranges[i].last, size);
+    out->iov[out->cnt++] = (struct iovec){ p, m };
+    out->iov[out->cnt++] = (struct iovec){ body + ranges[i].first,
+                                           ranges[i].last - ranges[i].first + 1 };
+    body_len += m;
+    p += m;
+  }
+  int m = snprintf(p, end - p, "\r\n--" RANGE_BOUNDARY "--\r\n");
+  out->iov[out->cnt++] = (struct iovec){ p, m };
+  body_len += m;
+
+  size_t h = range_headers(out->buf, RANGE_HDRS, item->headers, NULL, size, body_len, conn);
+  if (h == 0) return 0;
+  out->iov[0] = (struct iovec){ out->buf, h };
+  out->len = h + body_len;
+  return 1;
+}
+
+
+// parse "bytes=" and its comma separated ranges. Return how many, or
+// -1 if the header is not one the proxy serves
+static int parse_ranges(http_slice v, byte_range *ranges) {
+  const char *p = v.p, *end = v.p + v.len;
+  int n = 0;
+
+  if (v.len < 6 || strncasecmp(p, "bytes=", 6)) return -1;
+  p += 6;
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+    if (p == end) break;
+    if (n == RANGE_MAX) return -1;
+
+    byte_range *r = &ranges[n++];
+    r->first = r->last = -1;
+    if (*p != '-' && !digits(&p, end, &r->first)) return -1;
+    if (p == end || *p++ != '-') return -1;
+    if (p < end && *p >= '0' && *p <= '9' && !digits(&p, end, &r->last)) return -1;
+    if (r->first < 0 && r->last < 0) return -1;              // just "-"
+    if (r->first >= 0 && r->last >= 0 && r->last < r->first) return -1;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p < end && *p != ',') return -1;
+  }
+  return n? n:-1;
+}
+
+// read the number at *p into *v. Return 1 if there is one that fits
+static int digits(const char **p, const char *end, long *v) {
+  const char *start = *p;
+  for (*v = 0; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+    if (*v > (LONG_MAX - 9) / 10) return 0;
+    *v = *v * 10 + **p - '0';
+  }
+  return *p > start;
+}
+
+// an If-Range holds if it names the cached version: by its strong etag,
+// or by its exact Last-Modified date
+static int if_range_holds(http_slice v, const char *hdrs) {
+  char val[256];
+  if (v.len > 0 && v.p[0] == '"') {
+    return header_value(hdrs, "etag", val, sizeof(val)) && val[0] == '"' &&
+           strlen(val) == v.len && !memcmp(val, v.p, v.len);
+  }
+  if (v.len > 1 && v.p[0] == 'W' && v.p[1] == '/') return 0;   // weak, never
+  return header_value(hdrs, "last-modified", val, sizeof(val)) &&
+         strlen(val) == v.len && !memcmp(val, v.p, v.len);
+}
+
+// the framing of the stored response, which a 206 replaces
+static int skip_line(const char *line, int multipart) {
+  return !strncasecmp(line, "content-length:", 15) || !strncasecmp(line, "content-range:", 14) ||
+         (multipart && !strncasecmp(line, "content-type:", 13));
+}
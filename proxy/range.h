@@ -0,0 +1,47 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "cache.h"
+#include "http.h"
+
+#define RANGE_MAX 8                  // ranges served from one request
+#define RANGE_SEGMENT (64 * 1024)    // bytes per cached segment of an object
+#define RANGE_SEGMENTS_MAX 16        // segments a range may span, beyond that
+                                     // it is forwarded to the origin
+#define RANGE_CACHE_MAX (MAX_CACHE_SIZE / 4)   // bytes of segments one request
+                                               // may cache, the rest go uncached
+#define RANGE_HDRS 8192              // room for the headers of a 206
+#define RANGE_BOUNDARY "a5c6e0d1b2f3948b"
+
+/* a range of bytes, both ends included. Until it is resolved against
+ * the size of the object, a range open at the end has last -1, and a
+ * suffix range, the last n bytes, has first -1 and last n. */
+typedef struct {
+  long first;
+  long last;
+} byte_range;
+
+/* a 206 or 416 response made from a cached item, ready for writev */
+typedef struct {
+  char buf[RANGE_HDRS + (RANGE_MAX + 1) * 256];   // headers, then part headers
+  struct iovec iov[RANGE_MAX * 2 + 2];
+  int cnt;
+  size_t len;          // bytes of the whole response
+  int status;
+} range_resp;
+
+int range_request(const http_request *r, const char *hdrs, byte_range *ranges);
+int range_resolve(byte_range *r, long size);
+long range_total(const char *hdrs);
+long range_first(const char *hdrs);
+int range_same_object(const char *a, const char *b);
+size_t range_forward(const http_request *r, char *buf, size_t cap);
+size_t range_headers(char *buf, size_t cap, const char *hdrs, const byte_range *r,
+                     long total, size_t body_len, const char *conn);
+size_t range_416(char *buf, size_t cap, long total, const char *conn);
+int range_response(CachedItem *item, byte_range *ranges, int n, int keep_alive,
+                   range_resp *out);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE   // splice, memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include "relay.h"
+
+/*
+ * Zero-copy helpers. Kept apart from the rest of the proxy because they
+ * need _GNU_SOURCE, which does not get along with csapp.h.
+ */
+
+#define PIPE_CHUNK (64 * 1024)   // bytes moved per splice call
+
+// microseconds on the clock of now_us, which the tools built with this
+// file go without
+static long clock_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* wait_writable waits for socket fd to take more bytes, until deadline
+ * in microseconds of now_us. Return 0 once it does, otherwise -1, with
+ * errno EAGAIN if the deadline passed */
+int wait_writable(int fd, long deadline) {
+  while (1) {
+    long ms = (deadline - clock_us() + 999) / 1000;
+    if (ms <= 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    struct pollfd p = { .fd = fd, .events = POLLOUT };
+    int r = poll(&p, 1, (ms > 3600000)? 3600000:ms);
+    if (r > 0) return 0;
+    if (r < 0 && errno != EINTR) return -1;
+  }
+}
+
+
+/* relay_splice moves remaining bytes (or everything up to EOF when
+ * remaining is -1) from socket from to socket to through a pipe, so the
+ * body never gets copied into user space. A client that doesn't take a
+ * pipe load within write_ms fails it with errno EAGAIN: a splice into a
+ * blocking socket starts its SO_SNDTIMEO over with every bit of room it
+ * gets, so to is made non-blocking while we relay and waited on with poll.
+ * Return the bytes moved if succeed, otherwise return -1 */
+long relay_splice(int from, int to, long remaining, int write_ms) {
+  int pfd[2];
+  if (pipe(pfd) < 0) return -1;
+  int flags = fcntl(to, F_GETFL);
+  fcntl(to, F_SETFL, flags | O_NONBLOCK);
+
+  long rc = 0;
+  while (remaining != 0) {
+    size_t want = PIPE_CHUNK;
+    if (remaining > 0 && remaining < (long)want) want = remaining;
+
+    ssize_t n = splice(from, NULL, pfd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 || (n == 0 && remaining > 0)) {   // error or truncated
+      rc = -1;
+      break;
+    }
+    if (n == 0) break;   // close-delimited body
+
+    // drain the pipe into the client, holding partial segments back
+    // for more except at the end of the body
+    unsigned int more = (remaining != n)? SPLICE_F_MORE:0;
+    long deadline = clock_us() + write_ms * 1000L;
+    ssize_t left = n;
+    while (left > 0) {
+      ssize_t m = splice(pfd[0], NULL, to, NULL, left, SPLICE_F_MOVE | more);
+      if (m < 0 && errno == EINTR) continue;
+      if (m < 0 && errno == EAGAIN) {
+        if (wait_writable(to, deadline) == 0) continue;
+        rc = -1;
+        goto out;
+      }
+      if (m <= 0) {
+        rc = -1;
+        goto out;
+      }
+      left -= m;
+    }
+    rc += n;
+    if (remaining > 0) remaining -= n;
+  }
+
+out:
+  fcntl(to, F_SETFL, flags);
+  close(pfd[0]);
+  close(pfd[1]);
+  return rc;
+}
+
+
+/* arena_memfd creates the memfd backing the cache arena.
+ * Return the memfd, or -1 on failure */
+int arena_memfd(size_t size) {
+  int fd = memfd_create("cache-arena", MFD_CLOEXEC);
+  if (fd < 0) return -1;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/* sendfile_all sends size bytes of in_fd starting at off to socket
+ * out_fd, all of them within write_ms: out_fd is made non-blocking
+ * meanwhile and waited on with poll, as in relay_splice.
+ * Return size if succeed, otherwise return -1, with errno EAGAIN if it
+ * timed out */
+ssize_t sendfile_all(int out_fd, int in_fd, off_t off, size_t size, int write_ms) {
+  long deadline = clock_us() + write_ms * 1000L;
+  int flags = fcntl(out_fd, F_GETFL);
+  fcntl(out_fd, F_SETFL, flags | O_NONBLOCK);
+
+  ssize_t rc = size;
+  off_t end = off + size;
+  while (off < end) {
+    ssize_t n = sendfile(out_fd, in_fd, &off, end - off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN && wait_writable(out_fd, deadline) == 0) continue;
+    if (n <= 0) {
+      rc = -1;
+      break;
+    }
+  }
+  fcntl(out_fd, F_SETFL, flags);
+  return rc;
+}
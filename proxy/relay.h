@@ -0,0 +1,15 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* cached bodies at least this large are sent with sendfile */
+#define SENDFILE_MIN (16 * 1024)
+
+int wait_writable(int fd, long deadline);
+long relay_splice(int from, int to, long remaining, int write_ms);
+int arena_memfd(size_t size);
+ssize_t sendfile_all(int out_fd, int in_fd, off_t off, size_t size, int write_ms);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,105 @@
+/*
+ * replay_tool - replay a request trace against the cache and report the
+ * hit ratio and byte hit ratio of each eviction policy.
+ *
+ *   usage: replay_tool [-p policy] [tracefile]
+ *
+ * The trace has one request per line, "url size", read from stdin when
+ * no file is given. A miss caches the object, as the proxy would after
+ * fetching it. Build it with cache.c, policy.c, slab.c, disk.c, fresh.c,
+ * relay.c and csapp.c; it is not part of the proxy.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "csapp.h"
+#include "cache.h"
+#include "policy.h"
+
+typedef struct {
+  char *url;
+  size_t size;
+} request_t;
+
+static request_t *read_trace(FILE *fp, size_t *n);
+static void replay(const cache_policy *policy, request_t *reqs, size_t n);
+
+int main(int argc, char **argv) {
+  const cache_policy *only = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    if (opt != 'p' || (only = policy_by_name(optarg)) == NULL) {
+      fprintf(stderr, "usage: %s [-p %s] [tracefile]\n", argv[0], policy_names());
+      exit(1);
+    }
+  }
+
+  FILE *fp = stdin;
+  if (optind < argc && (fp = fopen(argv[optind], "r")) == NULL) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  size_t n;
+  request_t *reqs = read_trace(fp, &n);
+  if (fp != stdin) fclose(fp);
+
+  printf("%zu requests, cache %d bytes, objects up to %d bytes\n",
+         n, MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+  if (only) {
+    replay(only, reqs, n);
+  } else {
+    replay(&clock_policy, reqs, n);
+    replay(&lru_policy, reqs, n);
+    replay(&s3fifo_policy, reqs, n);
+    replay(&tinylfu_policy, reqs, n);
+  }
+  return 0;
+}
+
+// read every "url size" line of the trace, skipping malformed ones
+static request_t *read_trace(FILE *fp, size_t *n) {
+  size_t cap = 1024;
+  request_t *reqs = Malloc(cap * sizeof(request_t));
+  char line[MAXLINE], url[MAXLINE];
+  unsigned long size;
+
+  *n = 0;
+  while (fgets(line, MAXLINE, fp)) {
+    if (sscanf(line, "%s %lu", url, &size) != 2) continue;
+    if (*n == cap) {
+      cap *= 2;
+      if ((reqs = realloc(reqs, cap * sizeof(request_t))) == NULL)
+        unix_error("realloc error");
+    }
+    reqs[*n].url = strdup(url);
+    reqs[*n].size = size;
+    (*n)++;
+  }
+  return reqs;
+}
+
+// run the whole trace through a fresh cache using policy
+static void replay(const cache_policy *policy, request_t *reqs, size_t n) {
+  CacheList cache;
+  size_t i, hits = 0;
+  unsigned long long bytes = 0, hit_bytes = 0;
+
+  cache_init(&cache, policy);
+  for (i = 0; i < n; i++) {
+    bytes += reqs[i].size;
+    CachedItem *item = find(reqs[i].url, &cache);
+    if (item) {
+      hits++;
+      hit_bytes += item->size;
+      cache_release(item, &cache);
+    } else {
+      cache_URL(reqs[i].url, "", Calloc(1, reqs[i].size + 1), reqs[i].size, &cache);
+    }
+  }
+  cache_destruct(&cache);
+
+  printf("%-8s hit ratio %6.2f%%  byte hit ratio %6.2f%%\n", policy->name,
+         n ? 100.0 * hits / n : 0.0, bytes ? 100.0 * hit_bytes / bytes : 0.0);
+}
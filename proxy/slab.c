@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "slab.h"
+#include "relay.h"
+
+/*
+ * Size-classed slab arena holding the cache: every entry (metadata, url,
+ * headers and body together) is one chunk. The arena is a single memfd of
+ * SLAB_ARENA_SIZE mapped once at startup and cut into SLAB_PAGE_SIZE
+ * pages. A page is handed to one size class at a time, and goes back to
+ * the free pool once its last chunk is freed. So that a workload moving
+ * to other object sizes does not strand pages in the wrong classes, the
+ * cache can empty the page with the least in use, as memcached's slab
+ * rebalancer does, rather than evict at random until one happens to
+ * come free; chunks that are not cache items are pinned, and keep their
+ * pages from being picked. Size classes grow by 1.25 like memcached's,
+ * which keeps the space lost inside chunks to a few percent on average.
+ * Free pages beyond SLAB_SPARE_PAGES give their memory back to the
+ * kernel; the spare ones stay resident, since under churn a page is
+ * emptied and refilled again and again and every round trip through
+ * the kernel costs a madvise and a page fault per 4K.
+ */
+
+static int class_of(slab_arena *a, size_t size);
+static void list_remove(slab_arena *a, int *head, int i);
+static void list_push(slab_arena *a, int *head, int i);
+
+
+/* slab_init maps the arena and sets up the size classes. A shared arena
+ * keeps its page table in shared memory and its lock works across
+ * processes, so that processes forked afterwards allocate from it too.
+ * Return 0 if succeed, otherwise return -1 */
+int slab_init(slab_arena *a, int shared) {
+  if ((a->fd = arena_memfd(SLAB_ARENA_SIZE)) < 0) return -1;
+  a->base = mmap(NULL, SLAB_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+  if (a->base == MAP_FAILED) return -1;
+
+  a->npages = SLAB_ARENA_SIZE / SLAB_PAGE_SIZE;
+  a->shared = shared;
+  a->pages = shared? shared_calloc(a->npages * sizeof(slab_page)):
+                     calloc(a->npages, sizeof(slab_page));
+  if (a->pages == NULL) return -1;
+  a->free_pages = a->spare = -1;
+  int i;
+  for (i = a->npages - 1; i >= 0; i--) {
+    a->pages[i].cls = -1;
+    list_push(a, &a->free_pages, i);
+  }
+
+  // chunk sizes from SLAB_MIN_CHUNK up to a whole page, 16 byte aligned
+  size_t size = SLAB_MIN_CHUNK;
+  a->nclasses = 0;
+  while (a->nclasses < SLAB_MAX_CLASSES - 1 && size < SLAB_PAGE_SIZE) {
+    a->classes[a->nclasses].size = size;
+    a->classes[a->nclasses++].per_page = SLAB_PAGE_SIZE / size;
+    size = ((size_t)(size * 1.25) + 15) & ~(size_t)15;
+  }
+  a->classes[a->nclasses].size = SLAB_PAGE_SIZE;
+  a->classes[a->nclasses++].per_page = 1;
+  for (i = 0; i < a->nclasses; i++) a->classes[i].partial = -1;
+
+  a->requested = a->chunk_bytes = 0;
+  a->pages_used = a->spare_pages = 0;
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  if (shared) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&a->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return 0;
+}
+
+
+/* slab_alloc returns a chunk of at least size bytes, or NULL if its
+ * class has no free chunk and no free page is left */
+void *slab_alloc(slab_arena *a, size_t size) {
+  int c = class_of(a, size);
+  if (c < 0) return NULL;
+  slab_class *cls = &a->classes[c];
+
+  pthread_mutex_lock(&a->lock);
+  int i = cls->partial;
+  if (i < 0) {
+    // give the class a free page, a resident one if there is
+    if ((i = a->spare) >= 0) {
+      list_remove(a, &a->spare, i);
+      a->spare_pages--;
+    } else if ((i = a->free_pages) >= 0) {
+      list_remove(a, &a->free_pages, i);
+    } else {
+      pthread_mutex_unlock(&a->lock);
+      return NULL;
+    }
+    a->pages[i].cls = c;
+    a->pages[i].used = a->pages[i].bump = a->pages[i].pinned = 0;
+    a->pages[i].free = NULL;
+    list_push(a, &cls->partial, i);
+    a->pages_used++;
+  }
+
+  slab_page *pg = &a->pages[i];
+  void *p;
+  if (pg->free) {
+    p = pg->free;
+    pg->free = *(void **)p;
+  } else {
+    p = a->base + (size_t)i * SLAB_PAGE_SIZE + (size_t)pg->bump++ * cls->size;
+  }
+  if (++pg->used == cls->per_page) list_remove(a, &cls->partial, i);
+
+  a->requested += size;
+  a->chunk_bytes += cls->size;
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+
+
+/* slab_free gives back a chunk allocated with the given size. An empty
+ * page returns to the free pool, and its memory to the kernel unless it
+ * is kept as a spare. */
+void slab_free(slab_arena *a, void *p, size_t size) {
+  int i = ((char *)p - a->base) / SLAB_PAGE_SIZE;
+
+  pthread_mutex_lock(&a->lock);
+  slab_page *pg = &a->pages[i];
+  slab_class *cls = &a->classes[pg->cls];
+  if (pg->used-- == cls->per_page) list_push(a, &cls->partial, i);
+  *(void **)p = pg->free;
+  pg->free = p;
+  a->requested -= size;
+  a->chunk_bytes -= cls->size;
+
+  if (pg->used == 0) {
+    list_remove(a, &cls->partial, i);
+    pg->cls = -1;
+    a->pages_used--;
+    if (a->spare_pages < SLAB_SPARE_PAGES) {
+      list_push(a, &a->spare, i);
+      a->spare_pages++;
+    } else {
+      list_push(a, &a->free_pages, i);
+      madvise(a->base + (size_t)i * SLAB_PAGE_SIZE, SLAB_PAGE_SIZE, MADV_REMOVE);
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+}
+
+
+/* slab_pin counts the chunk at p as one that holds no cache item, with
+ * n 1, or no longer, with n -1. */
+void slab_pin(slab_arena *a, void *p, int n) {
+  int i = ((char *)p - a->base) / SLAB_PAGE_SIZE;
+  pthread_mutex_lock(&a->lock);
+  a->pages[i].pinned += n;
+  pthread_mutex_unlock(&a->lock);
+}
+
+
+/* slab_sparse_page returns the page in use with the fewest bytes handed
+ * out and nothing pinned, the cheapest one to empty for another size
+ * class, or NULL if there is none */
+void *slab_sparse_page(slab_arena *a) {
+  int i, best = -1;
+  size_t least = SLAB_PAGE_SIZE + 1;
+
+  pthread_mutex_lock(&a->lock);
+  for (i = 0; i < a->npages; i++) {
+    slab_page *pg = &a->pages[i];
+    if (pg->cls < 0 || pg->pinned) continue;
+    size_t bytes = pg->used * a->classes[pg->cls].size;
+    if (bytes < least) {
+      least = bytes;
+      best = i;
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+  return (best < 0)? NULL:a->base + (size_t)best * SLAB_PAGE_SIZE;
+}
+
+
+void slab_destroy(slab_arena *a) {
+  munmap(a->base, SLAB_ARENA_SIZE);
+  close(a->fd);
+  if (a->shared) munmap(a->pages, a->npages * sizeof(slab_page));
+  else free(a->pages);
+  pthread_mutex_destroy(&a->lock);
+}
+
+
+/* shared_calloc returns size zeroed bytes mapped shared, which the
+ * processes forked afterwards see at the same address, or NULL. */
+void *shared_calloc(size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return (p == MAP_FAILED)? NULL:p;
+}
+
+
+// smallest class that fits size, or -1
+static int class_of(slab_arena *a, size_t size) {
+  int i;
+  for (i = 0; i < a->nclasses; i++) {
+    if (a->classes[i].size >= size) return i;
+  }
+  return -1;
+}
+
+// take page i out of a page list, the caller holds the lock
+static void list_remove(slab_arena *a, int *head, int i) {
+  slab_page *pg = &a->pages[i];
+  if (pg->prev >= 0) a->pages[pg->prev].next = pg->next;
+  else *head = pg->next;
+  if (pg->next >= 0) a->pages[pg->next].prev = pg->prev;
+  pg->prev = pg->next = -1;
+}
+
+// put page i at the front of a page list, the caller holds the lock
+static void list_push(slab_arena *a, int *head, int i) {
+  slab_page *pg = &a->pages[i];
+  pg->prev = -1;
+  pg->next = *head;
+  if (*head >= 0) a->pages[*head].prev = i;
+  *head = i;
+}
@@ -0,0 +1,55 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef SLAB_ARENA_SIZE
+#define SLAB_ARENA_SIZE (4 * 1024 * 1024)   // bytes preallocated for the cache
+#endif
+#define SLAB_PAGE_SIZE (128 * 1024)         // unit handed to a size class
+#define SLAB_MIN_CHUNK 256                  // smallest size class
+#define SLAB_MAX_CLASSES 32
+#define SLAB_SPARE_PAGES 4                  // free pages kept resident for reuse
+
+typedef struct {
+  int cls;                 // size class, -1 while the page is free
+  int used;                // chunks handed out
+  int bump;                // chunks never handed out start here
+  int pinned;              // chunks holding something other than a cache item
+  void *free;              // chunks given back, linked through their first word
+  int prev, next;          // partial pages of the class, spare or free pages
+} slab_page;
+
+typedef struct {
+  size_t size;             // chunk size
+  int per_page;            // chunks in one page
+  int partial;             // first page with a free chunk, or -1
+} slab_class;
+
+typedef struct {
+  int fd;                  // memfd backing the arena, for sendfile
+  char *base;              // the arena, mapped shared
+  int npages;
+  slab_page *pages;
+  int free_pages;          // first free page, or -1
+  slab_class classes[SLAB_MAX_CLASSES];
+  int nclasses;
+  size_t requested;        // bytes asked for by live chunks
+  size_t chunk_bytes;      // bytes of live chunks
+  int pages_used;
+  int spare;               // first free page still resident, or -1
+  int spare_pages;
+  int shared;              // usable by the processes forked afterwards
+  pthread_mutex_t lock;
+} slab_arena;
+
+int slab_init(slab_arena *a, int shared);
+void *slab_alloc(slab_arena *a, size_t size);
+void slab_free(slab_arena *a, void *p, size_t size);
+void slab_pin(slab_arena *a, void *p, int n);
+void *slab_sparse_page(slab_arena *a);
+void slab_destroy(slab_arena *a);
+void *shared_calloc(size_t size);
+
+#endif /* __SLAB_H__ */
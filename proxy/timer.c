@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include "timer.h"
+
+/*
+ * Timing wheel for the deadlines of the event loops. Setting, moving or
+ * cancelling a deadline is a few pointer moves whatever the number of
+ * connections, which matters as every bit of progress on a connection
+ * moves its deadline. Deadlines are kept to TIMER_TICK_MS, and never
+ * fire early.
+ */
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+
+/* timer_init makes w an empty wheel, starting at now_ms. */
+void timer_init(timer_wheel *w, long now_ms) {
+  int i;
+  for (i = 0; i < TIMER_SLOTS; i++)
+    w->slots[i].prev = w->slots[i].next = &w->slots[i];
+  w->tick = now_ms / TIMER_TICK_MS;
+  w->count = 0;
+}
+
+
+/* timer_set arms t to expire at expires_ms, moving it if it was armed
+ * already. */
+void timer_set(timer_wheel *w, wheel_timer *t, long expires_ms) {
+  timer_cancel(w, t);
+  long tick = (expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  if (tick < w->tick) tick = w->tick;   // due already, the next expire takes it
+
+  wheel_timer *head = &w->slots[tick & TIMER_MASK];
+  t->expires = expires_ms;
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+  t->armed = 1;
+  w->count++;
+}
+
+/* timer_cancel disarms t, if it is armed. */
+void timer_cancel(timer_wheel *w, wheel_timer *t) {
+  if (!t->armed) return;
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->armed = 0;
+  w->count--;
+}
+
+
+/* timer_expire takes every timer due by now_ms off the wheel. Return
+ * them as a list linked by next, NULL if there is none. */
+wheel_timer *timer_expire(timer_wheel *w, long now_ms) {
+  wheel_timer *expired = NULL;
+  long now = now_ms / TIMER_TICK_MS;
+
+  // after a whole turn without looking, every slot is due once
+  if (now - w->tick >= TIMER_SLOTS) w->tick = now - TIMER_SLOTS + 1;
+  for (; w->tick <= now; w->tick++) {
+    wheel_timer *head = &w->slots[w->tick & TIMER_MASK], *t, *next;
+    for (t = head->next; t != head; t = next) {
+      next = t->next;
+      if ((t->expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS > w->tick) continue;   // a later turn
+      timer_cancel(w, t);
+      t->next = expired;
+      expired = t;
+    }
+  }
+  return expired;
+}
+
+
+/* timer_wait returns how many ms an event loop may sleep before the
+ * next tick is due, -1 for as long as it likes when nothing is armed. */
+int timer_wait(timer_wheel *w, long now_ms) {
+  if (w->count == 0) return -1;
+  long ms = w->tick * TIMER_TICK_MS - now_ms;
+  return (ms > 0)? (int)ms:0;
+}
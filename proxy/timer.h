@@ -0,0 +1,30 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#define TIMER_SLOTS 512      // slots of a wheel, a power of two
+#define TIMER_TICK_MS 100    // time a slot covers
+
+/* a deadline on a wheel, embedded in what it times */
+typedef struct wheel_timer {
+  long expires;                  // in ms of the monotonic clock
+  int armed;
+  struct wheel_timer *prev;
+  struct wheel_timer *next;      // in its slot, or in the expired list
+} wheel_timer;
+
+/* a hashed timing wheel: a timer goes in the slot of the tick it
+ * expires in, going around the wheel as often as it takes. Not locked,
+ * every event loop has its own. */
+typedef struct {
+  wheel_timer slots[TIMER_SLOTS];   // heads of circular lists
+  long tick;                        // next tick to expire
+  int count;                        // timers armed
+} timer_wheel;
+
+void timer_init(timer_wheel *w, long now_ms);
+void timer_set(timer_wheel *w, wheel_timer *t, long expires_ms);
+void timer_cancel(timer_wheel *w, wheel_timer *t);
+wheel_timer *timer_expire(timer_wheel *w, long now_ms);
+int timer_wait(timer_wheel *w, long now_ms);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "csapp.h"
+#include "upstream.h"
+#include "dns.h"
+#include "proxy.h"
+
+/*
+ * Pool of keep-alive connections to origin servers, keyed by host:port.
+ * Idle connections are handed out most recently used first, and are
+ * closed once they have been idle for UPSTREAM_IDLE_TIMEOUT seconds or
+ * the server has closed them. Each host has at most UPSTREAM_MAX_CONNS
+ * connections open, callers past that wait for one to come back. A
+ * server that sends or takes nothing for the read timeout (-t) fails
+ * the read or write waiting on it.
+ */
+
+struct upstream_host {
+  char *host;
+  char *port;
+  int idle[UPSTREAM_MAX_IDLE];            // oldest first
+  time_t idle_since[UPSTREAM_MAX_IDLE];
+  int nidle;
+  int nconns;                             // idle and in use
+  pthread_cond_t freed;                   // signaled when a connection comes back
+  struct upstream_host *next;
+};
+
+static upstream_host *hosts = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static upstream_host *lookup_host(const char *host, const char *port);
+static void expire_idle(upstream_host *h, time_t now);
+static int is_alive(int fd);
+
+
+/* upstream_get returns a connection to host:port, an idle one from the
+ * pool unless fresh is set. *hp is the handle to give the connection
+ * back with. Return the descriptor, or -1 if unable to connect. */
+int upstream_get(const char *host, const char *port, int fresh, upstream_host **hp) {
+  pthread_mutex_lock(&pool_lock);
+  upstream_host *h = *hp = lookup_host(host, port);
+
+  while (1) {
+    expire_idle(h, time(NULL));
+    while (!fresh && h->nidle > 0) {
+      int fd = h->idle[--h->nidle];
+      if (is_alive(fd)) {
+        pthread_mutex_unlock(&pool_lock);
+        return fd;
+      }
+      close(fd);
+      h->nconns--;
+    }
+    // a fresh one may take the place of an idle one
+    if (fresh && h->nconns == UPSTREAM_MAX_CONNS && h->nidle > 0) {
+      close(h->idle[0]);
+      memmove(h->idle, h->idle + 1, --h->nidle * sizeof(int));
+      memmove(h->idle_since, h->idle_since + 1, h->nidle * sizeof(time_t));
+      h->nconns--;
+    }
+    if (h->nconns < UPSTREAM_MAX_CONNS) break;
+    pthread_cond_wait(&h->freed, &pool_lock);
+  }
+  h->nconns++;
+  pthread_mutex_unlock(&pool_lock);
+
+  int fd = dns_connect(h->host, h->port);
+  if (fd < 0) {
+    pthread_mutex_lock(&pool_lock);
+    h->nconns--;
+    pthread_cond_signal(&h->freed);
+    pthread_mutex_unlock(&pool_lock);
+    return -1;
+  }
+  struct timeval tv = { timeouts.read, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+
+/* upstream_put gives a connection back. It is kept for reuse only when
+ * reusable is set, i.e. the last response on it was read completely
+ * and the server did not ask to close it. */
+void upstream_put(upstream_host *h, int fd, int reusable) {
+  pthread_mutex_lock(&pool_lock);
+  time_t now = time(NULL);
+  expire_idle(h, now);
+
+  if (reusable && h->nidle < UPSTREAM_MAX_IDLE) {
+    h->idle[h->nidle] = fd;
+    h->idle_since[h->nidle++] = now;
+  } else {
+    close(fd);
+    h->nconns--;
+  }
+  pthread_cond_signal(&h->freed);   // either way a waiter can go on
+  pthread_mutex_unlock(&pool_lock);
+}
+
+
+// find the entry of host:port, creating it on first use.
+// The caller holds pool_lock
+static upstream_host *lookup_host(const char *host, const char *port) {
+  upstream_host *h;
+  for (h = hosts; h; h = h->next) {
+    if (!strcasecmp(h->host, host) && !strcmp(h->port, port)) return h;
+  }
+
+  h = Calloc(1, sizeof(upstream_host));
+  h->host = strdup(host);
+  h->port = strdup(port);
+  pthread_cond_init(&h->freed, NULL);
+  h->next = hosts;
+  hosts = h;
+  return h;
+}
+
+// close idle connections older than the timeout, the caller holds pool_lock
+static void expire_idle(upstream_host *h, time_t now) {
+  int i, n = 0;
+  for (i = 0; i < h->nidle; i++) {
+    if (now - h->idle_since[i] >= UPSTREAM_IDLE_TIMEOUT) {
+      close(h->idle[i]);
+      h->nconns--;
+      pthread_cond_signal(&h->freed);
+    } else {
+      h->idle[n] = h->idle[i];
+      h->idle_since[n++] = h->idle_since[i];
+    }
+  }
+  h->nidle = n;
+}
+
+// an idle connection is usable if it has neither been closed by the
+// server nor received anything unexpected
+static int is_alive(int fd) {
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
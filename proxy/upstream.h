@@ -0,0 +1,13 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_MAX_IDLE 8        // idle connections kept per host
+#define UPSTREAM_MAX_CONNS 32      // connections per host, idle or in use
+#define UPSTREAM_IDLE_TIMEOUT 30   // seconds an idle connection is kept
+
+typedef struct upstream_host upstream_host;
+
+int upstream_get(const char *host, const char *port, int fresh, upstream_host **hp);
+void upstream_put(upstream_host *h, int fd, int reusable);
+
+#endif /* __UPSTREAM_H__ */
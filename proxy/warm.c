@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "proxy.h"
+#include "warm.h"
+#include "metrics.h"
+
+/*
+ * Cache warm-up, turned on with "proxy -W file[:top[:rate]]". The file
+ * is a list of urls, a trace of "url size" lines as replay_tool reads,
+ * or an access log written with -l, of which only the 200s count. Its
+ * urls are ranked by how often they were requested, and the top ones
+ * fetched into the cache by WARM_THREADS threads, starting at most rate
+ * fetches a second, while the proxy already serves clients: a client
+ * asking for a url on its way shares the fetch. No fetch is started once
+ * the cache has less room left than the largest object takes, past that
+ * they would push out the more popular objects brought in before.
+ */
+
+typedef struct {
+  char *url;
+  long count;
+} warm_url;
+
+static warm_url *urls;              // ranked, most requested first
+static int nurls;
+static int next_url;                // next one to fetch
+static long next_start;             // us when the next fetch may start
+static long interval;               // us between two fetch starts
+static int running;                 // threads not done yet
+static int cached;                  // urls the warm-up put in the cache
+static CacheList *cache;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *warmer(void *vargp);
+static int read_urls(FILE *fp, warm_url **out);
+static char *line_url(char *line);
+static int by_url(const void *a, const void *b);
+static int by_count(const void *a, const void *b);
+
+
+/* warm_start ranks the urls of the file at path and starts fetching the
+ * top of them into list in the background, rate a second.
+ * Return 0 if succeed, otherwise return -1 */
+int warm_start(const char *path, int top, int rate, CacheList *list) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  nurls = read_urls(fp, &urls);
+  fclose(fp);
+  if (nurls < 0) return -1;
+  if (nurls > top) nurls = top;
+
+  cache = list;
+  interval = 1000000L / rate;
+  next_start = now_us();
+  running = WARM_THREADS;
+
+  int i;
+  pthread_t tid;
+  for (i = 0; i < WARM_THREADS; i++) {
+    if (pthread_create(&tid, NULL, warmer, NULL)) return -1;
+    pthread_detach(tid);
+  }
+  return 0;
+}
+
+
+// take the next url and fetch it when its turn comes, until they are
+// all taken or the cache is full. The last thread done says how it went
+static void *warmer(void *vargp) {
+  (void)vargp;
+  while (1) {
+    pthread_mutex_lock(&lock);
+    if (next_url == nurls ||
+        __atomic_load_n(&cache->size, __ATOMIC_RELAXED) > MAX_CACHE_SIZE - MAX_OBJECT_SIZE) {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    char *url = urls[next_url++].url;
+    long now = now_us();
+    long at = (next_start > now)? next_start:now;
+    next_start = at + interval;
+    pthread_mutex_unlock(&lock);
+
+    if (at > now) {
+      struct timespec pause = { (at - now) / 1000000, (at - now) % 1000000 * 1000 };
+      nanosleep(&pause, NULL);
+    }
+    if (prefetch(url, cache) > 0) {
+      METRIC_ADD(warmed, 1);
+      __atomic_add_fetch(&cached, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  if (--running == 0) {
+    printf("warm-up cached %d of %d urls\n", cached, next_url);
+    int i;
+    for (i = 0; i < nurls; i++) free(urls[i].url);
+    free(urls);
+    urls = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// read the urls of every line of fp into *out, one entry per url with
+// the number of times it came up, most first. Return how many, or -1
+static int read_urls(FILE *fp, warm_url **out) {
+  char line[MAXLINE];
+  int n = 0, cap = 1024;
+  warm_url *u = malloc(cap * sizeof(warm_url));
+  if (u == NULL) return -1;
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *url = line_url(line);
+    if (url == NULL) continue;
+    if (n == cap) {
+      warm_url *bigger = realloc(u, 2 * cap * sizeof(warm_url));
+      if (bigger == NULL) break;
+      u = bigger;
+      cap *= 2;
+    }
+    if ((u[n].url = strdup(url)) == NULL) break;
+    u[n++].count = 1;
+  }
+
+  // the same urls next to each other, then counted into one entry
+  qsort(u, n, sizeof(warm_url), by_url);
+  int i, k = 0;
+  for (i = 0; i < n; i++) {
+    if (k > 0 && !strcmp(u[k - 1].url, u[i].url)) {
+      u[k - 1].count++;
+      free(u[i].url);
+    } else {
+      u[k++] = u[i];
+    }
+  }
+  qsort(u, k, sizeof(warm_url), by_count);
+  *out = u;
+  return k;
+}
+
+// the url of a line: its first field that is one. The sixth field of an
+// access log line, where the third is the status, counts only for a 200
+static char *line_url(char *line) {
+  char *field[6], *save, *f;
+  int i;
+  for (i = 0, f = strtok_r(line, " \t\r\n", &save); f && i < 6;
+       f = strtok_r(NULL, " \t\r\n", &save)) {
+    field[i++] = f;
+    if (strncmp(f, "http://", 7)) continue;
+    if (i == 6 && strcmp(field[2], "200")) return NULL;
+    return f;
+  }
+  return NULL;
+}
+
+static int by_url(const void *a, const void *b) {
+  return strcmp(((const warm_url *)a)->url, ((const warm_url *)b)->url);
+}
+
+// most requested first, and in the order of their urls among equals
+static int by_count(const void *a, const void *b) {
+  const warm_url *x = a, *y = b;
+  if (x->count != y->count) return (x->count > y->count)? -1:1;
+  return strcmp(x->url, y->url);
+}
@@ -0,0 +1,12 @@
+#ifndef __WARM_H__
+#define __WARM_H__
+
+#include "cache.h"
+
+#define WARM_TOP 1000      // urls prefetched by default, the most requested first
+#define WARM_RATE 50       // fetches started per second by default
+#define WARM_THREADS 4     // fetches on their way at once
+
+int warm_start(const char *path, int top, int rate, CacheList *cache);
+
+#endif /* __WARM_H__ */